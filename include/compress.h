@@ -0,0 +1,26 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+#include <stdint.h>
+
+//bytes 0x80-0xFE stand for dictionary fragments, 0xFF escapes a literal byte of 0x80 or above
+#define COMPRESS_CODE_FIRST 0x80
+#define COMPRESS_CODE_LITERAL 0xFF
+//longest dictionary fragment, the most one compressed byte can expand to
+#define COMPRESS_MAX_FRAGMENT 7
+
+typedef struct
+{
+    uint32_t entriesCompressed;
+    uint32_t bytesIn;
+    uint32_t bytesOut;
+    uint32_t compressCycles;
+    uint32_t bytesDecompressed;
+    uint32_t decompressCycles;
+} CompressionStats;
+
+int compressText(const uint8_t* input, uint16_t length, uint8_t* output, uint16_t capacity);
+int expandTextChunk(uint8_t* escaped, const uint8_t* input, uint16_t length, uint8_t* output, uint16_t capacity);
+int decompressText(const uint8_t* input, uint16_t length, uint8_t* output, uint16_t capacity);
+void getCompressionStats(CompressionStats* stats);
+
+#endif
@@ -2,7 +2,26 @@
 #define CRYPTO_H
 #include <stdint.h>
 
-void xorEncrypt(uint8_t*, uint16_t, uint8_t);
-void xorDecrypt(uint8_t*, uint16_t, uint8_t);
+//Speck64/128: 64 bit blocks as two 32 bit words, 128 bit key, 27 rounds
+#define CRYPTO_KEY_WORDS 4
+#define CRYPTO_ROUNDS 27
+#define CRYPTO_BLOCK_BYTES 8
 
-#endif
\ No newline at end of file
+//rounds of key stretching applied to the password at login
+#define CRYPTO_KDF_ITERATIONS 128
+
+typedef struct
+{
+    uint32_t bytesEncrypted;
+    uint32_t encryptCycles;
+    uint32_t bytesDecrypted;
+    uint32_t decryptCycles;
+} CryptoStats;
+
+void cryptoDeriveSessionKey(const char* password);
+void cryptoSetKey(const uint32_t key[CRYPTO_KEY_WORDS]);
+void cryptoEncrypt(uint8_t* data, uint16_t length, uint32_t nonce, uint32_t offset);
+void cryptoDecrypt(uint8_t* data, uint16_t length, uint32_t nonce, uint32_t offset);
+void cryptoGetStats(CryptoStats* stats);
+
+#endif
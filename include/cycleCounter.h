@@ -0,0 +1,12 @@
+#ifndef CYCLE_COUNTER_H
+#define CYCLE_COUNTER_H
+#include <stdint.h>
+#include "ramFunc.h"
+
+//the counter ticks at the 48MHz core clock
+#define CYCLES_PER_MS 48000
+
+void cycleCounterInit(void);
+RAMFUNC uint32_t cycleCounterNow(void);
+
+#endif
@@ -4,31 +4,244 @@
 #include <stdint.h>
 #include <stdio.h>
 #include "stm32f0xx.h" 
+#include "eepromDriver.h"
+#include "crypto.h"
+#include "storage.h"
+#include "textSearch.h"
 
 #define MAX_TAG_LENGTH 16
 #define MAX_CONTENT_LENGTH 128
-#define MAX_ENTRIES 50
-#define ENCRYPTION_KEY 0x55
 
+//entries the RAM index can hold, it costs 4 bytes of RAM per entry
+#ifndef MAX_ENTRIES
+#define MAX_ENTRIES 1024
+#endif
 
-#define INDEX_TABLE_ADDRESS FLASH_PAGE_62_ADDRESS
-#define CONTENT_START_ADDRESS (FLASH_PAGE_62_ADDRESS + 0x200)
+//set to 0 to store all new entries uncompressed
+#ifndef DIARY_COMPRESSION
+#define DIARY_COMPRESSION 1
+#endif
 
+//set to 0 to stop writing page checkpoints, mount then reads every record slot
+#ifndef DIARY_CHECKPOINTS
+#define DIARY_CHECKPOINTS 1
+#endif
+
+//background compaction keeps at least this many pages free while the command loop is idle
+#ifndef DIARY_GC_FREE_PAGES
+#define DIARY_GC_FREE_PAGES 3
+#endif
+
+//only pages with at least this many dead slots are worth an erase in the background
+#ifndef DIARY_GC_MIN_DEAD_SLOTS
+#define DIARY_GC_MIN_DEAD_SLOTS (STORAGE_DATA_SLOTS_PER_PAGE / 3)
+#endif
+
+//time a background step may run before it yields, it overruns by at most one extent copy
+//a page erase cannot be split and is always a step of its own
+#ifndef DIARY_GC_STEP_US
+#define DIARY_GC_STEP_US 1000
+#endif
+
+
+//an entry is one record slot followed by its content extents, all in the same storage page
+//content is stored as chains of fixed size extents, each starting with the slot of the next one
+#define EXTENT_SIZE STORAGE_SLOT_SIZE
+#define EXTENT_HEADER_SIZE 2
+#define EXTENT_PAYLOAD (EXTENT_SIZE - EXTENT_HEADER_SIZE)
+#define EXTENT_COUNT STORAGE_SLOT_COUNT
+#define EXTENT_NONE 0xFFFF
+#define EXTENT_ADDRESS(extent) STORAGE_SLOT_ADDRESS(extent)
+#define EXTENT_OF(address) STORAGE_SLOT_OF(address)
+//content always starts in the slot right after the record
+#define RECORD_FIRST_EXTENT(slot) ((slot) + 1)
+
+//longest entry that fits in a page next to its record
+#define MAX_ENTRY_LENGTH ((STORAGE_DATA_SLOTS_PER_PAGE - 1) * EXTENT_PAYLOAD)
+
+//free pages held back from new entries so compaction always has somewhere to copy to
+#define STORAGE_RESERVE_PAGES 1
+
+//first halfword of a record slot, extents start with a slot number which is always far lower
+//it is programmed after the rest of the record and is what commits the entry
+#define RECORD_MARKER 0xD1A7
+//a record whose entry was copied elsewhere, the page is erased soon after
+#define RECORD_MOVED 0x0000
+
+//flags halfword of an index record: left erased while live, programmed to zero as a tombstone
+#define ENTRY_FLAGS_LIVE 0xFFFF
+#define ENTRY_FLAGS_DELETED 0x0000
+#define ENTRY_IS_DELETED(meta) ((meta)->flags == ENTRY_FLAGS_DELETED)
+
+//individual flag bits are active low so they can be set in the same write as the record
+#define ENTRY_FLAG_COMPRESSED 0x0001
+#define ENTRY_IS_COMPRESSED(meta) (!ENTRY_IS_DELETED(meta) && ((meta)->flags & ENTRY_FLAG_COMPRESSED) == 0)
+
+//a page checkpoint only counts once this is programmed, it is the last halfword written
+#define CHECKPOINT_COMMIT 0xC0DE
+//every entry takes at least a record and one extent
+#define CHECKPOINT_MAX_RECORDS (STORAGE_DATA_SLOTS_PER_PAGE / 2)
+
+//one storage slot
 typedef struct 
 {
-    uint32_t flashAddress;
-    uint16_t length;
+    uint16_t marker;                //RECORD_MARKER once committed
+    uint16_t crc;                   //CRC-16 of the rest of the record, with the flags as first written
+    uint16_t length;                //content bytes across the whole chain
+    uint16_t flags;
     char tag[MAX_TAG_LENGTH];
     uint32_t timestamp;
+    uint32_t sequence;              //write order, never reused, also the keystream nonce of the content
 } DiaryEntryIndex;
 
+//summary of a closed page in its summary slots, lets a mount skip reading every record slot
+typedef struct
+{
+    uint8_t count;                  //records listed below
+    uint8_t fill;                   //page fill when the page was closed
+    struct
+    {
+        uint8_t slot;               //record slot within the page
+        uint8_t extents;
+        uint16_t tagHash;           //folded tag hash, as kept in the RAM index
+    } records[CHECKPOINT_MAX_RECORDS];
+    uint16_t commit;                //CHECKPOINT_COMMIT
+} PageCheckpoint;
+
+//counters for the last mount
+typedef struct
+{
+    uint32_t cycles;
+    uint16_t pages;                 //pages in use
+    uint16_t checkpointPages;       //pages indexed from their checkpoint
+    uint16_t entries;
+    uint16_t invalidRecords;        //committed records skipped for a bad CRC or extents outside the page
+    uint16_t uncommittedSlots;      //slots written past the last committed entry of the newest page
+    uint16_t duplicates;            //copies left by an interrupted relocation
+} DiaryMountStats;
+
+//counters for the RAM index cache
+typedef struct
+{
+    uint32_t loads;                 //full scans of the storage region
+    uint32_t recordReads;           //index records read from flash by those scans
+    uint32_t recordReadsAvoided;    //index record reads served from RAM instead
+    uint32_t tagSearches;           //tag searches started
+    uint32_t bloomRejects;          //searches answered "no match" by the bloom filter alone
+    uint32_t tagCandidates;         //records whose tag hash matched and needed a full compare
+} IndexCacheStats;
+
+//iterator state for walking every entry with a given tag
+typedef struct
+{
+    char tag[MAX_TAG_LENGTH];
+    uint16_t tagHash;
+    int next;                       //next index to examine, -1 once exhausted
+} TagSearch;
+
+//stored bytes read from flash per step of a content search
+#define CONTENT_SEARCH_CHUNK 16
+
+//iterator state for scanning the content of every live entry for a pattern
+typedef struct
+{
+    TextSearch matcher;
+    int next;                       //next index to scan, -1 once exhausted
+    uint32_t bytesScanned;          //stored bytes read so far
+    uint32_t entriesScanned;
+} ContentSearch;
+
+//resumable position in a range of the index, kept as sequences so compaction between pages cannot shift it
+typedef struct
+{
+    uint32_t nextSequence;          //first entry not handed out yet
+    uint32_t endSequence;           //entries from this sequence on are past the range
+} EntryCursor;
+
+//an entry being streamed into flash, from beginDiaryWrite to finishDiaryWrite
+typedef struct
+{
+    DiaryEntryIndex meta;           //record programmed once the content is complete
+    uint16_t slot;                  //storage slot the record goes into
+    uint16_t firstExtent;
+    uint16_t blockFill;             //plaintext bytes waiting in block
+    uint32_t nextAddress;           //where block gets programmed
+    uint32_t extentEnd;             //end of the extent being filled
+    uint32_t block[CRYPTO_BLOCK_BYTES / 4];
+} DiaryWriter;
+
+//an entry being streamed out of flash, one chunk at a time
+typedef struct
+{
+    uint32_t nonce;                 //sequence of the entry
+    uint16_t length;
+    uint16_t offset;                //content bytes already read
+    uint32_t address;               //next byte to read
+    uint32_t extentEnd;             //end of the extent being read
+    uint8_t decrypt;
+} DiaryReader;
+
+//counters for the write pipeline, cycles only cover time spent inside the write calls
+typedef struct
+{
+    uint32_t entries;
+    uint32_t bytes;
+    uint32_t slots;                 //record and extent slots programmed for new entries
+    uint32_t cycles;
+} DiaryWriteStats;
+
+//counters for page compaction
+typedef struct
+{
+    uint32_t pagesRecycled;
+    uint32_t entriesMoved;          //live entries copied out of pages being recycled
+    uint32_t slotsMoved;            //slots programmed by those copies
+    uint32_t backgroundSteps;       //idle-loop steps that did some work
+    uint32_t backgroundPages;       //pages recycled by those steps
+    uint32_t backgroundSlotsMoved;  //part of slotsMoved done in the background
+    uint32_t longestStepCycles;
+} DiaryCompactionStats;
+
+//slots programmed per slot of new content, times 100: (new + moved) / new
+#define DIARY_WRITE_AMPLIFICATION_X100(write, compaction) \
+    ((write)->slots ? (uint32_t)(((uint64_t)(write)->slots + (compaction)->slotsMoved) * 100 / (write)->slots) : 100)
+
 int addEntryIndex(const DiaryEntryIndex*);
 int getAllEntryIndices(DiaryEntryIndex*, uint16_t);
 int findEntryByTag(const char*, DiaryEntryIndex*);
-int storeDiaryEntry(const char* tag, const uint8_t* content, uint16_t length, uint8_t encrypt);
+void beginTagSearch(TagSearch* search, const char* tag);
+int nextTagMatch(TagSearch* search, DiaryEntryIndex* result);
+int beginContentSearch(ContentSearch* search, const char* pattern);
+int nextContentMatch(ContentSearch* search, uint32_t* offset);
+int storeDiaryEntry(const char* tag, const uint8_t* content, uint16_t length, uint16_t flags);
+int beginDiaryWrite(DiaryWriter* writer, const char* tag, uint16_t flags, uint16_t expectedLength);
+int appendDiaryWrite(DiaryWriter* writer, const uint8_t* data, uint16_t length);
+int finishDiaryWrite(DiaryWriter* writer);
+void abortDiaryWrite(DiaryWriter* writer);
+void getDiaryWriteStats(DiaryWriteStats* stats);
+void getDiaryCompactionStats(DiaryCompactionStats* stats);
+int diaryBackgroundStep(uint32_t budgetCycles);
 int loadDiaryEntry(uint32_t, uint16_t, uint8_t*);
 int getEntryCount(void);
-int retrieveDiaryEntry(uint16_t index, char* outputBuffer, uint8_t decrypt);
+int getLiveEntryCount(void);
+int findFirstEntrySince(uint32_t timestamp);
+int findLastLiveEntries(uint16_t count);
+int findEntryBySequence(uint32_t sequence);
+void openEntryCursor(EntryCursor* cursor, int first, int end);
+int nextCursorWindow(EntryCursor* cursor, uint16_t window, int* first);
+int entryCursorDone(const EntryCursor* cursor);
+int deleteDiaryEntry(uint16_t index);
+int retrieveDiaryEntry(uint16_t index, char* outputBuffer, uint16_t capacity, uint8_t decrypt);
+int beginDiaryRead(DiaryReader* reader, uint16_t index, uint8_t decrypt);
+int readDiaryChunk(DiaryReader* reader, uint8_t* buffer, uint16_t capacity);
 uint32_t findNextFreeAddress();
+int formatDiary(void);
+int mountDiary(void);
+void getDiaryMountStats(DiaryMountStats* stats);
+void loadIndexCache(void);
+void invalidateIndexCache(void);
+const DiaryEntryIndex* getCachedEntry(uint16_t index);
+uint32_t getEntryAddress(uint16_t index);
+void getIndexCacheStats(IndexCacheStats* stats);
 
 #endif
\ No newline at end of file
@@ -1,36 +1,74 @@
 /*
-using 2KB (2048) flash pages (62 and 63) on the STM32
+The EEPROM is emulated in a region of STORAGE_PAGE_COUNT 2KB (2048) flash pages at the top of the
+STM32F091's 256KB, from STORAGE_BASE_ADDRESS up to 0x08040000.
 
-Page 62: 0x800F800 - 0x0800FFFF (134281216 - 134283263)
-Page 63: 0x0800FC00 - 0x0800FFFF (134282240 - 134283263)
+With the default 32 pages the region is 0x08030000 - 0x0803FFFF and the firmware has the first 192KB,
+platformio.ini caps the image size so the two can never overlap.
 */
 
 #ifndef EEPROM_DRIVER_H
 #define EEPROM_DRIVER_H
 #include <stdint.h>
+#include "ramFunc.h"
 
 
 //flash page definitions
 #define FLASH_BASE_ADDRESS 0x08000000
+#define FLASH_END_ADDRESS 0x08040000
 #define FLASH_PAGE_SIZE 2048
-#define FLASH_PAGE_62_ADDRESS 0x0800F800
-#define FLASH_PAGE_63_ADDRESS 0x0800FC00
+
+//storage region, grow it with -DSTORAGE_PAGE_COUNT=n (and lower the image size cap to match)
+#ifndef STORAGE_PAGE_COUNT
+#define STORAGE_PAGE_COUNT 32
+#endif
+#define STORAGE_SIZE ((uint32_t)STORAGE_PAGE_COUNT * FLASH_PAGE_SIZE)
+#define STORAGE_BASE_ADDRESS (FLASH_END_ADDRESS - STORAGE_SIZE)
+#define STORAGE_END_ADDRESS FLASH_END_ADDRESS
+
+//start of the 2KB page holding an address
+#define FLASH_PAGE_START(address) ((address) - (((address) - FLASH_BASE_ADDRESS) % FLASH_PAGE_SIZE))
 
 //custom codes
 #define EEPROM_OK 0
 #define EEPROM_ERROR 1
 #define EEPROM_INVALID_ADDRESS 2
 #define EEPROM_WRITE_FAILED 3
+#define EEPROM_WRITE_PROTECTED 4
+#define EEPROM_TIMEOUT 5
+
+//flashProgram options
+#define FLASH_PROGRAM_VERIFY_ERASED 0x01
+
+//busy-wait iterations allowed for one halfword program (about 2ms at 48MHz)
+#define FLASH_PROGRAM_TIMEOUT 20000
+
+//counters kept by flashProgram
+typedef struct
+{
+    uint32_t batches;
+    uint32_t halfwords;
+    uint32_t cycles;
+    uint32_t errors;
+    uint32_t halfwordsPerMs;    //computed when the stats are read
+} FlashProgramStats;
 
 //status flag definitions
 //#define FLASH_SR_EOP 0x00000001
 
+void flashInit(void);
 void flashUnlock(void);
 void flashLock(void);
-void flashErasePage(uint32_t);
+RAMFUNC void flashErasePage(uint32_t);
 void flashWriteHalfword(uint32_t, uint16_t);
+int flashProgram(uint32_t address, const uint8_t* data, uint16_t length, uint8_t options);
+RAMFUNC int flashProgramBurst(uint32_t address, const uint8_t* data, uint16_t length, uint8_t options, uint32_t* programmed);
+void flashGetProgramStats(FlashProgramStats* stats);
 uint16_t flashReadHalfword(uint32_t);
+const uint8_t* flashMapSpan(uint32_t address, uint16_t length);
+uint32_t flashGetEraseCount(void);
+uint32_t flashGetBytesRead(void);
 int eepromWrite(uint32_t virtualAddress, const uint8_t* data, uint16_t length);
 int eepromRead(uint32_t, uint8_t*, uint16_t);
+const uint8_t* eepromView(uint32_t virtualAddress, uint16_t length);
 
 #endif
\ No newline at end of file
@@ -1,5 +1,6 @@
 #ifndef __FIFO_H__
 #define __FIFO_H__
+#include <stdint.h>
 
 struct fifo 
 {
@@ -0,0 +1,50 @@
+/*
+Simulated NOR flash used in place of the STM32 flash controller on host builds (HOST_BUILD).
+
+The simulated region covers the STORAGE_PAGE_COUNT storage pages starting at STORAGE_BASE_ADDRESS.
+It follows the F0 programming rules: erase sets a whole 2KB page to 0xFFFF, programming
+only clears bits, and a halfword that is not erased can only be programmed with 0x0000.
+*/
+
+#ifndef FLASH_SIM_H
+#define FLASH_SIM_H
+#include <stdint.h>
+#include "eepromDriver.h"
+
+#define FLASH_SIM_BASE_ADDRESS STORAGE_BASE_ADDRESS
+#define FLASH_SIM_PAGE_COUNT STORAGE_PAGE_COUNT
+#define FLASH_SIM_SIZE (FLASH_SIM_PAGE_COUNT * FLASH_PAGE_SIZE)
+
+//typical figures from the STM32F091 datasheet
+#define FLASH_SIM_DEFAULT_ERASE_US 20000
+#define FLASH_SIM_DEFAULT_PROGRAM_US 40
+#define FLASH_SIM_DEFAULT_READ_NS 42
+
+//no simulated power loss
+#define FLASH_SIM_NO_POWER_LOSS 0xFFFFFFFF
+
+typedef struct
+{
+    uint32_t eraseTimeUs;       //time for one page erase
+    uint32_t programTimeUs;     //time for one halfword program
+    uint32_t readTimeNs;        //time for one halfword read
+} FlashSimCostModel;
+
+typedef struct
+{
+    uint32_t pageErases;
+    uint32_t halfwordsProgrammed;
+    uint32_t halfwordsRead;
+    uint32_t programErrors;     //writes rejected because of locking or NOR rules
+    uint64_t busyTimeNs;        //flash time accumulated by the cost model
+} FlashSimCounters;
+
+void flashSimInit(const FlashSimCostModel* model);
+void flashSimSetCostModel(const FlashSimCostModel* model);
+void flashSimGetCounters(FlashSimCounters* out);
+void flashSimResetCounters(void);
+int flashSimLoadImage(const char* path);
+int flashSimSaveImage(const char* path);
+void flashSimPowerLossAfter(uint32_t halfwords);
+
+#endif
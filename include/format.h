@@ -0,0 +1,27 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+#include <stdint.h>
+
+//the shared line, long enough for any single line the commands print, longer output is sent in pieces
+#define FORMAT_LINE_SIZE 128
+
+//text built up in place and handed to the UART transmitter as one span, instead of a byte at a time through printf
+typedef struct
+{
+    char* text;
+    uint16_t capacity;
+    uint16_t length;
+} FormatBuffer;
+
+void formatInit(FormatBuffer* buffer, char* storage, uint16_t capacity);
+FormatBuffer* formatBegin(void);
+void formatText(FormatBuffer* buffer, const char* text);
+void formatSpan(FormatBuffer* buffer, const char* text, uint16_t length);
+void formatUnsigned(FormatBuffer* buffer, uint32_t value, uint8_t width, char pad);
+void formatSigned(FormatBuffer* buffer, int32_t value, uint8_t width);
+void formatHex(FormatBuffer* buffer, uint32_t value, uint8_t digits);
+void formatHundredths(FormatBuffer* buffer, uint32_t valueX100);
+void formatSend(FormatBuffer* buffer);
+void formatPuts(const char* text);
+
+#endif
@@ -0,0 +1,65 @@
+/*
+Host stand-in for the CMSIS device header, used only by native builds (HOST_BUILD).
+It provides just enough of the FLASH register block for the storage modules to compile,
+with FLASH pointing at the register mirror kept by the flash simulator.
+*/
+
+#ifndef HOST_STM32F0XX_H
+#define HOST_STM32F0XX_H
+#include <stdint.h>
+#include <stdlib.h>
+
+#define __IO volatile
+
+typedef struct
+{
+    __IO uint32_t ACR;
+    __IO uint32_t KEYR;
+    __IO uint32_t OPTKEYR;
+    __IO uint32_t SR;
+    __IO uint32_t CR;
+    __IO uint32_t AR;
+    __IO uint32_t RESERVED;
+    __IO uint32_t OBR;
+    __IO uint32_t WRPR;
+} FLASH_TypeDef;
+
+//register mirror owned by flashSim.c
+extern FLASH_TypeDef flashSimRegisters;
+#define FLASH (&flashSimRegisters)
+
+//flash status and control bits (same positions as the F0 reference manual)
+#define FLASH_SR_BSY 0x00000001
+#define FLASH_SR_PGERR 0x00000004
+#define FLASH_SR_WRPERR 0x00000010
+#define FLASH_SR_EOP 0x00000020
+#define FLASH_SR_EOP_Msk FLASH_SR_EOP
+#define FLASH_CR_PG 0x00000001
+#define FLASH_CR_PER 0x00000002
+#define FLASH_CR_STRT 0x00000040
+#define FLASH_CR_LOCK 0x00000080
+
+#define SystemCoreClock 48000000UL
+
+static inline uint32_t SysTick_Config(uint32_t ticks)
+{
+    (void)ticks;
+    return 0;
+}
+
+//there are no interrupts on the host, so nothing to mask
+static inline void __disable_irq(void)
+{
+}
+
+static inline void __enable_irq(void)
+{
+}
+
+//a reset on the host just ends the process
+static inline void NVIC_SystemReset(void)
+{
+    exit(0);
+}
+
+#endif
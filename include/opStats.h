@@ -0,0 +1,63 @@
+#ifndef OP_STATS_H
+#define OP_STATS_H
+#include <stdint.h>
+
+//latency histograms and flash traffic per operation, -DOP_STATS=0 compiles the hooks out
+#ifndef OP_STATS
+#define OP_STATS 1
+#endif
+
+//log2 buckets of microseconds: bucket 0 is under 2us, bucket b is 2^b to 2^(b+1)-1 us, the last is open ended
+#define OP_STATS_BUCKETS 20
+
+typedef enum
+{
+    OP_STORE,           //storeDiaryEntry
+    OP_ERASE,           //one page erase
+    OP_FIND,            //tag lookups
+    OP_RETRIEVE,        //retrieveDiaryEntry
+    OP_LIST,            //the list command
+    OP_COUNT
+} OpStatsOperation;
+
+typedef struct
+{
+    uint32_t calls;
+    uint64_t totalCycles;
+    uint32_t maxCycles;
+    uint32_t bytesRead;
+    uint32_t bytesProgrammed;
+    uint32_t pagesErased;
+    uint32_t buckets[OP_STATS_BUCKETS];
+} OpStats;
+
+//counters sampled when an operation starts
+typedef struct
+{
+    uint32_t cycles;
+    uint32_t bytesRead;
+    uint32_t halfwordsProgrammed;
+    uint32_t pagesErased;
+} OpStatsScope;
+
+//OP_STATS_PAUSE/OP_STATS_RESUME leave work done in the middle of an operation out of it, like printing its results
+#if OP_STATS
+#define OP_STATS_BEGIN(scope) OpStatsScope scope; opStatsBegin(&scope)
+#define OP_STATS_END(scope, operation) opStatsEnd(&scope, operation)
+#define OP_STATS_PAUSE(pause) OpStatsScope pause; opStatsBegin(&pause)
+#define OP_STATS_RESUME(scope, pause) opStatsResume(&scope, &pause)
+#else
+#define OP_STATS_BEGIN(scope)
+#define OP_STATS_END(scope, operation)
+#define OP_STATS_PAUSE(pause)
+#define OP_STATS_RESUME(scope, pause)
+#endif
+
+void opStatsBegin(OpStatsScope* scope);
+void opStatsEnd(const OpStatsScope* scope, OpStatsOperation operation);
+void opStatsResume(OpStatsScope* scope, const OpStatsScope* pause);
+void opStatsGet(OpStatsOperation operation, OpStats* stats);
+const char* opStatsName(OpStatsOperation operation);
+void opStatsReset(void);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef RAM_FUNC_H
+#define RAM_FUNC_H
+
+//code that has to keep running while the flash is erasing or programming
+//the F0 stalls every fetch from flash until the operation ends, so this code goes to the .RamFunc
+//section, which STM32F091RCTx_FLASH.ld places in .data for the startup code to copy into SRAM
+//SRAM is out of BL range from flash, so calls to it load the address instead (long_call)
+#ifndef HOST_BUILD
+#define RAMFUNC __attribute__((section(".RamFunc"), long_call, noinline))
+#else
+#define RAMFUNC
+#endif
+
+#endif
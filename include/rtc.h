@@ -1,9 +1,38 @@
 #ifndef RTC_H
 #define RTC_H
 #include <stdint.h>
+#include "ramFunc.h"
+
+//timestamps are seconds since 1970-01-01 00:00:00, the RTC calendar covers 2000 to 2099
+#define RTC_FIRST_TIMESTAMP 946684800u      //2000-01-01 00:00:00, also where an unset clock starts
+#define RTC_LAST_TIMESTAMP 4102444799u      //2099-12-31 23:59:59
+
+//"YYYY-MM-DD HH:MM:SS" plus the terminator
+#define RTC_TEXT_LENGTH 20
+
+typedef struct
+{
+    uint32_t seconds;               //timestamp
+    uint16_t milliseconds;
+} RtcTime;
+
+//how regularly a 1ms tick was serviced while the probe ran, a long gap means interrupts were held off
+typedef struct
+{
+    uint32_t ticks;
+    uint32_t longestGapCycles;      //between two tick handlers, nominally CYCLES_PER_MS
+    uint32_t lostTicks;             //ticks that merged into a later one because the handler could not run
+} RtcTickStats;
 
 void rtcInit(void);
 uint32_t rtcGetTimestamp(void);
-void rtcSetTimestamp(uint32_t timestamp);
+void rtcGetTime(RtcTime* time);
+int rtcSetTimestamp(uint32_t timestamp);
+int rtcIsSet(void);
+void rtcFormatTimestamp(uint32_t timestamp, char* text);
+int rtcParseTimestamp(const char* text, uint32_t* timestamp);
+void rtcStartTickProbe(void);
+void rtcStopTickProbe(RtcTickStats* stats);
+RAMFUNC void SysTick_Handler(void);
 
-#endif
\ No newline at end of file
+#endif
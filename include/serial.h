@@ -4,9 +4,15 @@
 
 void handleWriteCommand(void);
 void handleSearchCommand(const char* tag);
-void handleReadCommand(uint16_t index);
+void handleGrepCommand(const char* pattern);
+void handleReadCommand(uint32_t number);
 void parseCommand(const char* input);
-void handleDeleteCommand(uint16_t index);
-void handleListCommand(void);
+void handleDeleteCommand(uint32_t number);
+void handleListCommand(const char* argument);
+void handleMoreCommand(void);
+void handleFormatCommand(void);
+void handleTimeCommand(const char* argument);
+void handleStatsCommand(void);
+void handleWearCommand(void);
 void handleLogoutCommand(void);
 #endif
\ No newline at end of file
@@ -0,0 +1,97 @@
+/*
+Page-level management of the diary's flash region (STORAGE_BASE_ADDRESS to STORAGE_END_ADDRESS).
+
+The region is split into 32 byte slots. Slot 0 of every page is a header holding the page's
+erase count and, once the page is in use, the order it was opened in. The last
+STORAGE_SUMMARY_SLOTS slots are left to the page's owner for a summary written when it is closed.
+Pages are filled one at a time; a full or partly dead page only returns to the free pool by
+being recycled (erased).
+New pages are always the least erased free page, which spreads wear over the whole region.
+Every erase also stamps the region's lifetime byte counters into the new header, so they survive
+a reset without a metadata page of their own; a reset loses at most what was programmed since the last erase.
+*/
+
+#ifndef STORAGE_H
+#define STORAGE_H
+#include <stdint.h>
+#include "eepromDriver.h"
+
+#define STORAGE_SLOT_SIZE 32
+#define STORAGE_SLOTS_PER_PAGE (FLASH_PAGE_SIZE / STORAGE_SLOT_SIZE)
+#define STORAGE_SLOT_COUNT (STORAGE_PAGE_COUNT * STORAGE_SLOTS_PER_PAGE)
+#define STORAGE_SUMMARY_SLOTS 4
+#define STORAGE_FIRST_DATA_SLOT 1
+#define STORAGE_DATA_END_SLOT (STORAGE_SLOTS_PER_PAGE - STORAGE_SUMMARY_SLOTS)
+#define STORAGE_DATA_SLOTS_PER_PAGE (STORAGE_DATA_END_SLOT - STORAGE_FIRST_DATA_SLOT)
+
+#define STORAGE_SLOT_ADDRESS(slot) (STORAGE_BASE_ADDRESS + (uint32_t)(slot) * STORAGE_SLOT_SIZE)
+#define STORAGE_SLOT_OF(address) (((address) - STORAGE_BASE_ADDRESS) / STORAGE_SLOT_SIZE)
+#define STORAGE_PAGE_ADDRESS(page) (STORAGE_BASE_ADDRESS + (uint32_t)(page) * FLASH_PAGE_SIZE)
+#define STORAGE_PAGE_OF_SLOT(slot) ((slot) / STORAGE_SLOTS_PER_PAGE)
+#define STORAGE_SUMMARY_ADDRESS(page) (STORAGE_PAGE_ADDRESS(page) + STORAGE_DATA_END_SLOT * STORAGE_SLOT_SIZE)
+
+#define STORAGE_NO_PAGE 0xFFFF
+#define STORAGE_NO_SLOT 0xFFFF
+
+#define STORAGE_PAGE_MAGIC 0x57A6
+#define STORAGE_SEQUENCE_FREE 0xFFFFFFFF
+//lifetime fields of a header written before they existed
+#define STORAGE_STAMP_UNKNOWN 0xFFFFFFFF
+
+//rated erase cycles of a flash page (STM32F091 datasheet, N_END)
+#define STORAGE_ERASE_ENDURANCE 10000
+//no projection until the observed erase rate covers at least this long
+#define STORAGE_MIN_PROJECTION_SECONDS 3600
+
+//slot 0 of every page
+typedef struct
+{
+    uint16_t magic;                 //STORAGE_PAGE_MAGIC once the page has been formatted
+    uint16_t reserved;
+    uint32_t eraseCount;            //erases of this page, carried over every time it is recycled
+    uint32_t sequence;              //order the page was opened in, erased while the page is free
+    uint32_t sequenceFloor;         //next sequence when the page was erased, keeps sequences rising across a format
+    uint32_t logicalBytes;          //region lifetime counters when the page was erased, see StorageLifetimeStats
+    uint32_t physicalBytes;
+    uint32_t erasedAt;              //RTC timestamp of the erase
+    uint32_t firstErasedAt;         //oldest stamped erase of the region, carried from header to header
+} StoragePageHeader;
+
+typedef struct
+{
+    uint32_t minErases;
+    uint32_t maxErases;
+    uint32_t totalErases;
+    uint16_t freePages;
+    uint16_t pagesInUse;
+} StorageWearStats;
+
+//bytes written to the region over its whole life, not just since reset
+typedef struct
+{
+    uint32_t logicalBytes;          //content the owner reported with storageCountLogical
+    uint32_t physicalBytes;         //everything programmed: content, records, headers, summaries and compaction copies
+    uint32_t firstErasedAt;         //start of the observed history, STORAGE_STAMP_UNKNOWN if there is none yet
+} StorageLifetimeStats;
+
+int storageFormat(void);
+void storageScanPages(void);
+int storagePagesInOrder(uint16_t* order);
+uint16_t storageOpenPage(void);
+int storageRecyclePage(uint16_t page);
+uint16_t storageTakeSlot(void);
+uint16_t storageSlotsLeft(void);
+uint16_t storageActivePage(void);
+uint16_t storageFreePageCount(void);
+uint16_t storagePageFill(uint16_t page);
+uint16_t storagePageDead(uint16_t page);
+uint32_t storageSlotSequence(uint16_t slot);
+void storageMarkDead(uint16_t slot, uint16_t count);
+uint16_t storagePickVictim(uint16_t exclude);
+uint32_t storagePageEraseCount(uint16_t page);
+void storageGetWearStats(StorageWearStats* stats);
+void storageCountLogical(uint16_t bytes);
+void storageGetLifetimeStats(StorageLifetimeStats* stats);
+uint32_t storageProjectedDaysLeft(uint32_t now);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef TEXT_SEARCH_H
+#define TEXT_SEARCH_H
+#include <stdint.h>
+
+//longest pattern, the matcher keeps this many bytes minus one of history between chunks
+#define TEXT_SEARCH_MAX_PATTERN 32
+//bytes searched in one pass, longer chunks are fed through in pieces
+#define TEXT_SEARCH_WINDOW 64
+
+//Horspool matcher over a stream fed in chunks of any size, a match may span chunks
+typedef struct
+{
+    uint8_t pattern[TEXT_SEARCH_MAX_PATTERN];
+    uint8_t length;
+    uint8_t shift[256];             //skip for the byte under the last pattern position
+    uint8_t held;                   //bytes of the previous chunk kept at the front of buffer
+    uint32_t offset;                //stream offset of buffer[0]
+    uint8_t buffer[TEXT_SEARCH_MAX_PATTERN - 1 + TEXT_SEARCH_WINDOW];
+} TextSearch;
+
+int textSearchInit(TextSearch* search, const char* pattern);
+void textSearchRestart(TextSearch* search);
+int32_t textSearchFeed(TextSearch* search, const uint8_t* data, uint16_t length);
+
+#endif
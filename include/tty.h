@@ -1,6 +1,7 @@
 #ifndef __TTY_H__
 #define __TTY_H__
 #include "fifo.h"
+#include "ramFunc.h"
 
 extern struct fifo input_fifo;
 
@@ -9,6 +10,9 @@ void raw_mode(void);
 void cooked_mode(void);
 int line_buffer_getchar(void);
 void insert_echo_char(char ch);
+RAMFUNC int tty_queue_char(char ch);
+int tty_input_pending(void);
+void tty_process_input(void);
 
 int __io_putchar(int c);
 
@@ -0,0 +1,26 @@
+#ifndef UART_RX_H
+#define UART_RX_H
+#include <stdint.h>
+#include "ramFunc.h"
+
+//size of the circular DMA receive ring, can be overridden from the build flags
+#ifndef UART_RX_DMA_SIZE
+#define UART_RX_DMA_SIZE 64
+#endif
+
+typedef struct
+{
+    uint32_t bytesReceived;
+    uint32_t spans;             //times the ring was drained into the receive queue
+    uint32_t idleEvents;        //USART idle-line interrupts
+    uint32_t dmaEvents;         //DMA half and full transfer interrupts
+    uint32_t overruns;          //USART overrun errors
+    uint32_t droppedBytes;      //bytes lost because the receive queue was full
+} UartRxStats;
+
+void uartRxInit(void);
+RAMFUNC void uartRxHandleUsartInterrupt(void);
+RAMFUNC void uartRxHandleDmaInterrupt(void);
+void uartRxGetStats(UartRxStats* stats);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef UART_TX_H
+#define UART_TX_H
+#include <stdint.h>
+#include "ramFunc.h"
+
+//size of the transmit ring drained by DMA
+#ifndef UART_TX_RING_SIZE
+#define UART_TX_RING_SIZE 256
+#endif
+
+//cycles per byte the old busy-wait on TXE spent, 10 bits at 115200 baud on the 48 MHz core, calculated
+#define UART_TX_POLLED_CYCLES_PER_BYTE 4170
+
+typedef struct
+{
+    uint32_t bytesQueued;
+    uint32_t dmaTransfers;
+    uint32_t cpuCycles;         //cycles spent queueing, including any wait for ring space
+} UartTxStats;
+
+void uartTxInit(void);
+int uartTxWrite(const char* data, int length);
+void uartTxFlush(void);
+RAMFUNC void uartTxHandleDmaInterrupt(void);
+void uartTxGetStats(UartTxStats* stats);
+void uartTxResetStats(void);
+
+#endif
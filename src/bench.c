@@ -0,0 +1,809 @@
+/*
+This module is the host benchmark for the diary storage engine, built by the native PlatformIO environment.
+It runs fixed workloads over the flash simulator: filling the store, scanning its text, a mix of
+writes, reads, searches and deletes, a long delete-and-write churn, an entry refused for being too long, a long entry read back,
+power cut at every halfword of a store, a streamed store and a compaction, the input FIFO and the output formatter. Every run
+uses the same seed, so two builds can be compared on the same operations. Each workload prints one JSON object per line.
+Flash time comes from the simulator's cost model, ops/sec from the host clock.
+*/
+
+#ifdef HOST_BUILD
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "diary.h"
+#include "flashSim.h"
+#include "crypto.h"
+#include "compress.h"
+#include "fifo.h"
+#include "cycleCounter.h"
+#include "format.h"
+#include "rtc.h"
+
+#define BENCH_SEED 0x2545F491
+#define BENCH_TAGS 32
+#define BENCH_MIXED_OPS 5000
+#define BENCH_CHURN_OPS 20000
+#define BENCH_FIFO_LINES 200000
+#define BENCH_FORMAT_LINES 200000
+
+//the diary reports progress and errors on stdout, results go to a copy of it taken before that is silenced
+static FILE* results;
+static uint32_t rngState;
+
+//counters at the start of a workload
+typedef struct
+{
+    struct timespec start;
+    FlashSimCounters flash;
+    DiaryWriteStats write;
+    DiaryCompactionStats compaction;
+    CryptoStats crypto;
+    uint32_t bytesWritten;          //plaintext handed to the store
+} BenchRun;
+
+static const char* const words[] =
+{
+    "the", "and", "today", "was", "with", "that", "meeting", "went", "well", "after",
+    "lunch", "we", "finished", "the", "project", "report", "tomorrow", "I", "need", "to",
+    "call", "about", "flash", "memory", "board", "tired", "but", "happy", "weekend", "plans"
+};
+
+//xorshift32, the same sequence on every host
+static uint32_t benchRandom(void)
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 17;
+    rngState ^= rngState << 5;
+    return rngState;
+}
+
+static void benchTag(char* tag)
+{
+    snprintf(tag, MAX_TAG_LENGTH, "tag%02lu", (unsigned long)(benchRandom() % BENCH_TAGS));
+}
+
+//fills text with words up to a random length below MAX_CONTENT_LENGTH, returns its length without the terminator
+static uint16_t benchText(char* text)
+{
+    uint16_t target = 20 + benchRandom() % (MAX_CONTENT_LENGTH - 40);
+    uint16_t length = 0;
+    while(length < target)
+    {
+        const char* word = words[benchRandom() % (sizeof(words) / sizeof(words[0]))];
+        uint16_t wordLength = strlen(word);
+        if(length + wordLength + 1 >= MAX_CONTENT_LENGTH)
+        {
+            break;
+        }
+        memcpy(text + length, word, wordLength);
+        length += wordLength;
+        text[length++] = ' ';
+    }
+    text[length] = '\0';
+    return length;
+}
+
+//stores a random entry the way the write command does, compressing it when that helps
+static int benchStore(BenchRun* run)
+{
+    char tag[MAX_TAG_LENGTH];
+    char text[MAX_CONTENT_LENGTH];
+    benchTag(tag);
+    uint16_t length = benchText(text) + 1;
+
+    const uint8_t* payload = (const uint8_t*)text;
+    uint16_t stored = length;
+    uint16_t flags = ENTRY_FLAGS_LIVE;
+    #if DIARY_COMPRESSION
+    uint8_t packed[MAX_CONTENT_LENGTH];
+    int packedLength = compressText(payload, length, packed, length - 1);
+    if(packedLength > 0)
+    {
+        payload = packed;
+        stored = packedLength;
+        flags &= ~ENTRY_FLAG_COMPRESSED;
+    }
+    #endif
+
+    if(storeDiaryEntry(tag, payload, stored, flags) != 0)
+    {
+        return -1;
+    }
+    run->bytesWritten += length;
+    return 0;
+}
+
+//index of a random live entry, or -1 if a few tries found none
+static int benchPickLive(void)
+{
+    int count = getEntryCount();
+    for(int tries = 0; count > 0 && tries < 16; tries++)
+    {
+        int index = benchRandom() % count;
+        const DiaryEntryIndex* meta = getCachedEntry(index);
+        if(meta && !ENTRY_IS_DELETED(meta))
+        {
+            return index;
+        }
+    }
+    return -1;
+}
+
+static int benchDeleteOldest(void)
+{
+    int count = getEntryCount();
+    for(int index = 0; index < count; index++)
+    {
+        if(deleteDiaryEntry(index) == 0)
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+//lets compaction run as it would while the prompt waits for the next command
+static void benchIdle(void)
+{
+    diaryBackgroundStep(DIARY_GC_STEP_US * (CYCLES_PER_MS / 1000));
+}
+
+//starts from an erased simulator and an empty diary
+static void benchReset(void)
+{
+    flashSimInit(NULL);
+    formatDiary();
+    rngState = BENCH_SEED;
+}
+
+static void benchBegin(BenchRun* run)
+{
+    flashSimGetCounters(&run->flash);
+    getDiaryWriteStats(&run->write);
+    getDiaryCompactionStats(&run->compaction);
+    cryptoGetStats(&run->crypto);
+    run->bytesWritten = 0;
+    clock_gettime(CLOCK_MONOTONIC, &run->start);
+}
+
+//prints the common fields of a workload, the caller adds its own and closes the object
+static void benchReport(const char* workload, const BenchRun* run, uint32_t ops)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - run->start.tv_sec) + (end.tv_nsec - run->start.tv_nsec) / 1e9;
+
+    FlashSimCounters flash;
+    DiaryWriteStats write;
+    DiaryCompactionStats compaction;
+    CryptoStats crypto;
+    flashSimGetCounters(&flash);
+    getDiaryWriteStats(&write);
+    getDiaryCompactionStats(&compaction);
+    cryptoGetStats(&crypto);
+
+    uint32_t erases = flash.pageErases - run->flash.pageErases;
+    uint64_t programmed = (uint64_t)(flash.halfwordsProgrammed - run->flash.halfwordsProgrammed) * 2;
+    uint32_t newSlots = write.slots - run->write.slots;
+    uint32_t movedSlots = compaction.slotsMoved - run->compaction.slotsMoved;
+
+    fprintf(results, "{\"workload\":\"%s\",\"ops\":%lu,\"seconds\":%.6f,\"ops_per_sec\":%.1f", workload,
+        (unsigned long)ops, seconds, seconds > 0 ? ops / seconds : 0.0);
+    fprintf(results, ",\"flash_ms\":%.3f,\"page_erases\":%lu,\"bytes_written\":%lu,\"bytes_programmed\":%llu",
+        (flash.busyTimeNs - run->flash.busyTimeNs) / 1e6, (unsigned long)erases,
+        (unsigned long)run->bytesWritten, (unsigned long long)programmed);
+    fprintf(results, ",\"write_amplification\":%.3f,\"slot_write_amplification\":%.3f",
+        run->bytesWritten ? (double)programmed / run->bytesWritten : 0.0,
+        newSlots ? (double)(newSlots + movedSlots) / newSlots : 0.0);
+    fprintf(results, ",\"pages_recycled\":%lu,\"crypto_bytes\":%lu,\"live_entries\":%d",
+        (unsigned long)(compaction.pagesRecycled - run->compaction.pagesRecycled),
+        (unsigned long)((crypto.bytesEncrypted - run->crypto.bytesEncrypted) + (crypto.bytesDecrypted - run->crypto.bytesDecrypted)),
+        getLiveEntryCount());
+}
+
+//writes until the store refuses an entry, returns how many fit
+static int benchFill(void)
+{
+    BenchRun run;
+    benchReset();
+    benchBegin(&run);
+    uint32_t stored = 0;
+    while(benchStore(&run) == 0)
+    {
+        stored++;
+    }
+    benchReport("fill", &run, stored);
+    fprintf(results, "}\n");
+    return stored;
+}
+
+//scans the full store left by benchFill for a pattern no entry contains, then checks a common one against strstr
+static void benchGrep(void)
+{
+    ContentSearch search;
+    uint32_t offset;
+    BenchRun run;
+    struct timespec end;
+
+    benchBegin(&run);
+    beginContentSearch(&search, "zebra crossing");
+    while(nextContentMatch(&search, &offset) >= 0)
+    {
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - run.start.tv_sec) + (end.tv_nsec - run.start.tv_nsec) / 1e9;
+    uint32_t scanned = search.bytesScanned;
+    benchReport("grep", &run, search.entriesScanned);
+
+    //every entry the matcher reports, and only those, has to contain the pattern at that offset
+    const char* pattern = "weekend plans";
+    uint32_t hits = 0, mismatches = 0;
+    char content[MAX_CONTENT_LENGTH + 1];
+    beginContentSearch(&search, pattern);
+    for(int index = 0; index < getEntryCount(); index++)
+    {
+        const char* at = (retrieveDiaryEntry(index, content, sizeof(content), 1) >= 0) ? strstr(content, pattern) : NULL;
+        if(!at)
+        {
+            continue;
+        }
+        if(nextContentMatch(&search, &offset) != index || offset != (uint32_t)(at - content))
+        {
+            mismatches++;
+        }
+        hits++;
+    }
+    if(nextContentMatch(&search, &offset) >= 0)
+    {
+        mismatches++;
+    }
+    fprintf(results, ",\"bytes_scanned\":%lu,\"kb_per_sec\":%.1f,\"hits\":%lu,\"mismatches\":%lu}\n",
+        (unsigned long)scanned, seconds > 0 ? scanned / 1024.0 / seconds : 0.0, (unsigned long)hits, (unsigned long)mismatches);
+}
+
+//a half full store taking writes, reads, tag searches and deletes in a 25/30/20/25 mix, so it stays about half full
+static void benchMixed(int capacity)
+{
+    BenchRun run;
+    benchReset();
+    BenchRun prefill = { 0 };
+    for(int i = 0; i < capacity / 2; i++)
+    {
+        benchStore(&prefill);
+    }
+
+    uint32_t writes = 0, reads = 0, searches = 0, deletes = 0, failed = 0;
+    char content[MAX_CONTENT_LENGTH + 1];
+    benchBegin(&run);
+    for(uint32_t op = 0; op < BENCH_MIXED_OPS; op++)
+    {
+        uint32_t roll = benchRandom() % 100;
+        if(roll < 25)
+        {
+            //a full store makes room the way a user would, by deleting the oldest entry
+            if(benchStore(&run) != 0 && (benchDeleteOldest() != 0 || benchStore(&run) != 0))
+            {
+                failed++;
+            }
+            writes++;
+        }
+        else if(roll < 55)
+        {
+            int index = benchPickLive();
+            if(index < 0 || retrieveDiaryEntry(index, content, sizeof(content), 1) < 0)
+            {
+                failed++;
+            }
+            reads++;
+        }
+        else if(roll < 75)
+        {
+            char tag[MAX_TAG_LENGTH];
+            DiaryEntryIndex meta;
+            benchTag(tag);
+            findEntryByTag(tag, &meta);
+            searches++;
+        }
+        else
+        {
+            int index = benchPickLive();
+            if(index < 0 || deleteDiaryEntry(index) != 0)
+            {
+                failed++;
+            }
+            deletes++;
+        }
+        benchIdle();
+    }
+    benchReport("mixed", &run, BENCH_MIXED_OPS);
+    fprintf(results, ",\"writes\":%lu,\"reads\":%lu,\"searches\":%lu,\"deletes\":%lu,\"failed\":%lu}\n",
+        (unsigned long)writes, (unsigned long)reads, (unsigned long)searches, (unsigned long)deletes, (unsigned long)failed);
+}
+
+//keeps the store three quarters full, deleting the oldest entry for every new one
+static void benchChurn(int capacity)
+{
+    BenchRun run;
+    benchReset();
+    BenchRun prefill = { 0 };
+    for(int i = 0; i < capacity * 3 / 4; i++)
+    {
+        benchStore(&prefill);
+    }
+
+    uint32_t failed = 0;
+    StorageWearStats wearBefore;
+    storageGetWearStats(&wearBefore);
+    benchBegin(&run);
+    for(uint32_t op = 0; op < BENCH_CHURN_OPS; op++)
+    {
+        if(benchDeleteOldest() != 0 || benchStore(&run) != 0)
+        {
+            failed++;
+        }
+        benchIdle();
+    }
+
+    StorageWearStats wear;
+    StorageLifetimeStats lifetime;
+    storageGetWearStats(&wear);
+    storageGetLifetimeStats(&lifetime);
+    //churn steps until the most worn page reaches its rated endurance, at the rate this run wore it
+    uint32_t gained = wear.maxErases - wearBefore.maxErases;
+    uint64_t stepsLeft = gained ? (uint64_t)(STORAGE_ERASE_ENDURANCE - wear.maxErases) * BENCH_CHURN_OPS / gained : 0;
+
+    benchReport("churn", &run, BENCH_CHURN_OPS);
+    fprintf(results, ",\"failed\":%lu,\"min_page_erases\":%lu,\"max_page_erases\":%lu",
+        (unsigned long)failed, (unsigned long)wear.minErases, (unsigned long)wear.maxErases);
+    fprintf(results, ",\"lifetime_write_amplification\":%.3f,\"steps_to_endurance\":%llu}\n",
+        lifetime.logicalBytes ? (double)lifetime.physicalBytes / lifetime.logicalBytes : 0.0, (unsigned long long)stepsLeft);
+}
+
+//slots taken and counted dead over the whole region
+static void benchSlotTotals(uint32_t* taken, uint32_t* dead)
+{
+    *taken = 0;
+    *dead = 0;
+    for(uint16_t page = 0; page < STORAGE_PAGE_COUNT; page++)
+    {
+        *taken += storagePageFill(page);
+        *dead += storagePageDead(page);
+    }
+}
+
+//streams an entry past MAX_ENTRY_LENGTH the way the write command does, then checks that the abort
+//counted every slot it took as dead and that background compaction reclaims them
+static void benchAbort(void)
+{
+    BenchRun run;
+    benchReset();
+    benchBegin(&run);
+    for(int i = 0; i < 8; i++)
+    {
+        benchStore(&run);
+    }
+
+    uint32_t takenBefore, deadBefore, takenAfter, deadAfter;
+    benchSlotTotals(&takenBefore, &deadBefore);
+    DiaryWriter writer;
+    char chunk[MAX_CONTENT_LENGTH];
+    memset(chunk, 'x', sizeof(chunk));
+    uint32_t appended = 0;
+    uint32_t failed = 1;
+    if(beginDiaryWrite(&writer, "long", ENTRY_FLAGS_LIVE, MAX_CONTENT_LENGTH) == 0)
+    {
+        while(appended <= MAX_ENTRY_LENGTH && appendDiaryWrite(&writer, (const uint8_t*)chunk, sizeof(chunk)) == 0)
+        {
+            appended += sizeof(chunk);
+        }
+        //the store has to refuse the entry before it passes MAX_ENTRY_LENGTH
+        failed = (appended > MAX_ENTRY_LENGTH);
+    }
+    uint16_t abortedPage = STORAGE_PAGE_OF_SLOT(writer.slot);
+    abortDiaryWrite(&writer);
+    benchSlotTotals(&takenAfter, &deadAfter);
+    uint32_t leaked = (takenAfter - takenBefore) - (deadAfter - deadBefore);
+
+    //once the page is no longer being filled and free pages run low, compaction has to pick it and recycle it
+    uint32_t steps = 0;
+    while((storageActivePage() == abortedPage || storageFreePageCount() >= DIARY_GC_FREE_PAGES) && benchStore(&run) == 0)
+    {
+    }
+    uint16_t freeBefore = storageFreePageCount();
+    while(diaryBackgroundStep(DIARY_GC_STEP_US * (CYCLES_PER_MS / 1000)) && steps < 10000)
+    {
+        steps++;
+    }
+    uint32_t deadLeft = storagePageDead(abortedPage);
+
+    benchReport("abort", &run, 1);
+    fprintf(results, ",\"failed\":%lu,\"bytes_refused_at\":%lu,\"slots_taken\":%lu,\"slots_leaked\":%lu,\"gc_steps\":%lu,\"dead_slots_left\":%lu",
+        (unsigned long)failed, (unsigned long)appended, (unsigned long)(takenAfter - takenBefore), (unsigned long)leaked,
+        (unsigned long)steps, (unsigned long)deadLeft);
+    fprintf(results, ",\"free_pages_before_gc\":%u,\"free_pages_after_gc\":%u}\n", freeBefore, storageFreePageCount());
+}
+
+//streams an entry several times MAX_CONTENT_LENGTH long, then reads it back whole and into a
+//MAX_CONTENT_LENGTH buffer, which has to get the start of the text rather than an error
+static void benchLongRead(void)
+{
+    BenchRun run;
+    benchReset();
+    benchBegin(&run);
+
+    static char text[MAX_CONTENT_LENGTH * 8];
+    static char whole[sizeof(text) + 1];
+    char content[MAX_CONTENT_LENGTH + 1];
+    for(uint16_t i = 0; i < sizeof(text) - 1; i++)
+    {
+        text[i] = 'a' + i % 26;
+    }
+    text[sizeof(text) - 1] = '\0';
+
+    DiaryWriter writer;
+    uint32_t failed = 1;
+    if(beginDiaryWrite(&writer, "long", ENTRY_FLAGS_LIVE, MAX_CONTENT_LENGTH) == 0)
+    {
+        if(appendDiaryWrite(&writer, (const uint8_t*)text, sizeof(text)) == 0 && finishDiaryWrite(&writer) == 0)
+        {
+            failed = 0;
+        }
+        else
+        {
+            abortDiaryWrite(&writer);
+        }
+    }
+
+    int index = getEntryCount() - 1;
+    int wholeLength = failed ? -1 : retrieveDiaryEntry(index, whole, sizeof(whole), 1);
+    int cutLength = failed ? -1 : retrieveDiaryEntry(index, content, sizeof(content), 1);
+    uint32_t wholeOk = (wholeLength == sizeof(text) && strcmp(whole, text) == 0);
+    uint32_t cutOk = (cutLength == MAX_CONTENT_LENGTH && strncmp(content, text, MAX_CONTENT_LENGTH) == 0 &&
+        content[MAX_CONTENT_LENGTH] == '\0');
+
+    benchReport("long_read", &run, 2);
+    fprintf(results, ",\"failed\":%lu,\"length\":%u,\"whole_ok\":%lu,\"truncated_ok\":%lu}\n",
+        (unsigned long)failed, (unsigned)sizeof(text), (unsigned long)wholeOk, (unsigned long)cutOk);
+}
+
+//what a remount must find of one entry, content as stored so a relocated copy compares equal
+typedef struct
+{
+    uint32_t sequence;
+    uint32_t timestamp;
+    uint16_t length;
+    uint16_t flags;
+    char tag[MAX_TAG_LENGTH];
+    uint32_t contentHash;
+} BenchEntryImage;
+
+typedef struct
+{
+    int count;
+    BenchEntryImage entries[MAX_ENTRIES];
+} BenchDiaryImage;
+
+//FNV-1a over the stored bytes of an entry, 0 if its chain cannot be read
+static uint32_t benchContentHash(uint16_t index)
+{
+    DiaryReader reader;
+    uint8_t chunk[CONTENT_SEARCH_CHUNK];
+    uint32_t hash = 2166136261u;
+    if(beginDiaryRead(&reader, index, 0) != 0)
+    {
+        return 0;
+    }
+    int length;
+    while((length = readDiaryChunk(&reader, chunk, sizeof(chunk))) > 0)
+    {
+        for(int i = 0; i < length; i++)
+        {
+            hash = (hash ^ chunk[i]) * 16777619u;
+        }
+    }
+    return (length < 0) ? 0 : hash;
+}
+
+static void benchCaptureDiary(BenchDiaryImage* image)
+{
+    image->count = getEntryCount();
+    for(int i = 0; i < image->count; i++)
+    {
+        const DiaryEntryIndex* meta = getCachedEntry(i);
+        BenchEntryImage* entry = &image->entries[i];
+        entry->sequence = meta->sequence;
+        entry->timestamp = meta->timestamp;
+        entry->length = meta->length;
+        entry->flags = meta->flags;
+        memcpy(entry->tag, meta->tag, MAX_TAG_LENGTH);
+        entry->contentHash = ENTRY_IS_DELETED(meta) ? 0 : benchContentHash(i);
+    }
+}
+
+static int benchSameDiary(const BenchDiaryImage* a, const BenchDiaryImage* b)
+{
+    return a->count == b->count && memcmp(a->entries, b->entries, a->count * sizeof(a->entries[0])) == 0;
+}
+
+//the operations cut short by a power loss, each starts from the same mounted image
+enum { BENCH_CUT_STORE, BENCH_CUT_STREAM, BENCH_CUT_COMPACT, BENCH_CUT_OPS };
+static const char* const cutNames[BENCH_CUT_OPS] = { "store", "stream", "compact" };
+
+static void benchCutOperation(int op)
+{
+    BenchRun scratch = { 0 };
+    //the same entry on every run of the operation
+    rngState = BENCH_SEED + op;
+    if(op == BENCH_CUT_STORE)
+    {
+        benchStore(&scratch);
+    }
+    else if(op == BENCH_CUT_STREAM)
+    {
+        char text[MAX_CONTENT_LENGTH * 5];
+        memset(text, 's', sizeof(text) - 1);
+        text[sizeof(text) - 1] = '\0';
+        DiaryWriter writer;
+        if(beginDiaryWrite(&writer, "stream", ENTRY_FLAGS_LIVE, MAX_CONTENT_LENGTH) != 0)
+        {
+            return;
+        }
+        if(appendDiaryWrite(&writer, (const uint8_t*)text, sizeof(text)) != 0 || finishDiaryWrite(&writer) != 0)
+        {
+            abortDiaryWrite(&writer);
+        }
+    }
+    else
+    {
+        for(int steps = 0; steps < 10000 && diaryBackgroundStep(DIARY_GC_STEP_US * (CYCLES_PER_MS / 1000)); steps++)
+        {
+        }
+    }
+}
+
+//cuts power after every halfword a store, a streamed store and a background compaction program, then resets
+//and remounts from the saved image: each remount has to find the diary exactly as before or as after the operation,
+//and has to accept a new entry
+static void benchPowerLoss(void)
+{
+    char basePath[] = "/tmp/diary-bench-base-XXXXXX";
+    char crashPath[] = "/tmp/diary-bench-crash-XXXXXX";
+    int baseFile = mkstemp(basePath);
+    int crashFile = mkstemp(crashPath);
+    if(baseFile < 0 || crashFile < 0)
+    {
+        fprintf(stderr, "bench: cannot create the flash image files\n");
+        return;
+    }
+    close(baseFile);
+    close(crashFile);
+
+    //a store low on free pages with dead slots to collect, so compaction has work and stores may relocate
+    BenchRun run;
+    benchReset();
+    while(storageFreePageCount() >= DIARY_GC_FREE_PAGES && benchStore(&run) == 0)
+    {
+    }
+    for(int index = 0; index < getEntryCount(); index += 3)
+    {
+        deleteDiaryEntry(index);
+    }
+    flashSimSaveImage(basePath);
+
+    static BenchDiaryImage before, after, found;
+    benchBegin(&run);
+    uint32_t trials = 0, oldFound = 0, newFound = 0, broken = 0, unwritable = 0, duplicates = 0;
+    uint32_t cutHalfwords[BENCH_CUT_OPS], cutBroken[BENCH_CUT_OPS];
+    for(int op = 0; op < BENCH_CUT_OPS; op++)
+    {
+        //the uninterrupted run gives the state after the operation and how many halfwords it programs
+        flashSimLoadImage(basePath);
+        mountDiary();
+        benchCaptureDiary(&before);
+        FlashSimCounters start, end;
+        flashSimGetCounters(&start);
+        benchCutOperation(op);
+        flashSimGetCounters(&end);
+        benchCaptureDiary(&after);
+        uint32_t halfwords = end.halfwordsProgrammed - start.halfwordsProgrammed;
+        uint32_t opBroken = 0;
+
+        for(uint32_t cut = 0; cut < halfwords; cut++)
+        {
+            flashSimLoadImage(basePath);
+            mountDiary();
+            flashSimPowerLossAfter(cut);
+            benchCutOperation(op);
+
+            //the reset: flash keeps what reached it, RAM is rebuilt by the mount
+            flashSimSaveImage(crashPath);
+            flashSimPowerLossAfter(FLASH_SIM_NO_POWER_LOSS);
+            flashSimLoadImage(crashPath);
+            mountDiary();
+            DiaryMountStats mount;
+            getDiaryMountStats(&mount);
+            duplicates += (mount.duplicates > 0);
+
+            benchCaptureDiary(&found);
+            if(benchSameDiary(&found, &before))
+            {
+                oldFound++;
+            }
+            else if(benchSameDiary(&found, &after))
+            {
+                newFound++;
+            }
+            else
+            {
+                opBroken++;
+            }
+            if(benchStore(&run) != 0 || getEntryCount() != found.count + 1)
+            {
+                unwritable++;
+            }
+            trials++;
+        }
+        broken += opBroken;
+        cutHalfwords[op] = halfwords;
+        cutBroken[op] = opBroken;
+    }
+
+    benchReport("power_loss", &run, trials);
+    fprintf(results, ",\"old_state\":%lu,\"new_state\":%lu,\"broken\":%lu,\"unwritable\":%lu,\"duplicates_resolved\":%lu",
+        (unsigned long)oldFound, (unsigned long)newFound, (unsigned long)broken, (unsigned long)unwritable,
+        (unsigned long)duplicates);
+    for(int op = 0; op < BENCH_CUT_OPS; op++)
+    {
+        fprintf(results, "%s{\"op\":\"%s\",\"halfwords\":%lu,\"broken\":%lu}", op ? "," : ",\"cuts\":[",
+            cutNames[op], (unsigned long)cutHalfwords[op], (unsigned long)cutBroken[op]);
+    }
+    fprintf(results, "]}\n");
+
+    remove(basePath);
+    remove(crashPath);
+}
+
+//pushes command lines through the input FIFO the way the receive path and gets() do
+static void benchFifo(void)
+{
+    static struct fifo input;
+    static const char line[] = "search work\n";
+    struct timespec start, end;
+    uint32_t bytes = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(uint32_t i = 0; i < BENCH_FIFO_LINES; i++)
+    {
+        for(const char* c = line; *c; c++)
+        {
+            fifo_insert(&input, *c);
+        }
+        while(fifo_newline(&input))
+        {
+            fifo_remove(&input);
+            bytes++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(results, "{\"workload\":\"fifo\",\"ops\":%lu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"bytes\":%lu}\n",
+        (unsigned long)BENCH_FIFO_LINES, seconds, seconds > 0 ? BENCH_FIFO_LINES / seconds : 0.0, (unsigned long)bytes);
+}
+
+static double benchSeconds(const struct timespec* start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+//formats a listing line with the format module and with snprintf, the text is compared but never sent
+static void benchFormat(void)
+{
+    static const char tag[] = "work";
+    char text[FORMAT_LINE_SIZE];
+    char reference[FORMAT_LINE_SIZE];
+    char when[RTC_TEXT_LENGTH];
+    struct timespec start;
+    uint32_t mismatches = 0;
+    FormatBuffer line;
+    formatInit(&line, text, sizeof(text));
+
+    rngState = BENCH_SEED;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(uint32_t i = 0; i < BENCH_FORMAT_LINES; i++)
+    {
+        line.length = 0;
+        rtcFormatTimestamp(RTC_FIRST_TIMESTAMP + i * 3607, when);
+        formatText(&line, "\r\n");
+        formatSigned(&line, i % 300, 2);
+        formatText(&line, ": [");
+        formatText(&line, tag);
+        formatText(&line, "] (Time: ");
+        formatText(&line, when);
+        formatText(&line, ", Size: ");
+        formatUnsigned(&line, benchRandom() % MAX_CONTENT_LENGTH, 0, ' ');
+        formatText(&line, " bytes)");
+    }
+    double formatSeconds = benchSeconds(&start);
+
+    rngState = BENCH_SEED;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(uint32_t i = 0; i < BENCH_FORMAT_LINES; i++)
+    {
+        time_t seconds = RTC_FIRST_TIMESTAMP + i * 3607;
+        struct tm calendar;
+        gmtime_r(&seconds, &calendar);
+        snprintf(when, sizeof(when), "%04u-%02u-%02u %02u:%02u:%02u", calendar.tm_year + 1900, calendar.tm_mon + 1,
+            calendar.tm_mday, calendar.tm_hour, calendar.tm_min, calendar.tm_sec);
+        snprintf(reference, sizeof(reference), "\r\n%2d: [%s] (Time: %s, Size: %d bytes)",
+            (int)(i % 300), tag, when, (int)(benchRandom() % MAX_CONTENT_LENGTH));
+    }
+    double printfSeconds = benchSeconds(&start);
+
+    //the two must agree on every line, checked outside the timed loops
+    rngState = BENCH_SEED;
+    for(uint32_t i = 0; i < BENCH_FORMAT_LINES; i++)
+    {
+        uint32_t size = benchRandom() % MAX_CONTENT_LENGTH;
+        time_t seconds = RTC_FIRST_TIMESTAMP + i * 3607;
+        struct tm calendar;
+        gmtime_r(&seconds, &calendar);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &calendar);
+        snprintf(reference, sizeof(reference), "\r\n%2d: [%s] (Time: %s, Size: %d bytes)", (int)(i % 300), tag, when, (int)size);
+
+        line.length = 0;
+        rtcFormatTimestamp(seconds, when);
+        formatText(&line, "\r\n");
+        formatSigned(&line, i % 300, 2);
+        formatText(&line, ": [");
+        formatText(&line, tag);
+        formatText(&line, "] (Time: ");
+        formatText(&line, when);
+        formatText(&line, ", Size: ");
+        formatUnsigned(&line, size, 0, ' ');
+        formatText(&line, " bytes)");
+        if(line.length != strlen(reference) || memcmp(text, reference, line.length) != 0)
+        {
+            mismatches++;
+        }
+    }
+
+    fprintf(results, "{\"workload\":\"format\",\"ops\":%lu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"ns_per_line\":%.1f,"
+        "\"printf_ns_per_line\":%.1f,\"mismatches\":%lu}\n",
+        (unsigned long)BENCH_FORMAT_LINES, formatSeconds, formatSeconds > 0 ? BENCH_FORMAT_LINES / formatSeconds : 0.0,
+        formatSeconds * 1e9 / BENCH_FORMAT_LINES, printfSeconds * 1e9 / BENCH_FORMAT_LINES, (unsigned long)mismatches);
+}
+
+//usage: bench [results.jsonl], results go to stdout without a path
+int main(int argc, char** argv)
+{
+    results = (argc > 1) ? fopen(argv[1], "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if(!results || !freopen("/dev/null", "w", stdout))
+    {
+        fprintf(stderr, "bench: cannot open the results output\n");
+        return 1;
+    }
+
+    cycleCounterInit();
+    cryptoDeriveSessionKey("benchmark");
+
+    int capacity = benchFill();
+    benchGrep();
+    benchMixed(capacity);
+    benchChurn(capacity);
+    benchAbort();
+    benchLongRead();
+    benchPowerLoss();
+    benchFifo();
+    benchFormat();
+
+    fclose(results);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,178 @@
+/*
+This module implements a small static-dictionary text codec for diary content.
+Common English fragments are replaced by single byte codes, everything else is copied as a literal.
+The dictionary lives in flash, the only RAM used is a 192 byte lookup table by first character.
+*/
+
+#include "compress.h"
+#include "cycleCounter.h"
+
+//grouped by first character, longest first within a group so the first hit is the longest match
+static const char* const dictionary[] =
+{
+    " really", " today", " about", " think", " that", " with", " this", " have", " went", " will",
+    " just", " they", " what", " from", " were", " when", " like", " very", " time", " some",
+    " good", " want", " feel", " the", " and", " was", " for", " you", " but", " not", " had",
+    " day", " got", " all", " she", " her", " his", " are", " out", " to", " of", " in", " is",
+    " it", " on", " he", " be", " my", " at", " we", " so", " me", " up", " a", " I", ", ", ". ",
+    "an", "at", "al", "ar", "as", "ay", "ac", "co", "ce", "ch", "d ", "de", "ent", "ed ", "er ",
+    "e ", "er", "en", "es", "ed", "ea", "ee", "he", "ha", "hi", "ing ", "ight", "ing", "ion", "in",
+    "is", "it", "io", "ic", "ly ", "le", "ll", "li", "me", "ma", "ne ", "nd", "nt", "ng", "ne",
+    "ould", "on", "or", "ou", "ow", "oo", "ot", "re", "ri", "ro", "ra", "s ", "st", "se", "si",
+    "tion", "t ", "th", "ti", "te", "ur", "us", "ve", "wa", "y "
+};
+
+#define DICTIONARY_SIZE (sizeof(dictionary) / sizeof(dictionary[0]))
+_Static_assert(DICTIONARY_SIZE <= COMPRESS_CODE_LITERAL - COMPRESS_CODE_FIRST, "dictionary codes would overlap the literal escape");
+
+//range of dictionary entries starting with each printable character (32-127)
+static uint8_t bucketStart[96];
+static uint8_t bucketEnd[96];
+static uint8_t bucketsReady = 0;
+static CompressionStats compressionStats;
+
+static void buildBuckets(void)
+{
+    for(uint8_t i = 0; i < DICTIONARY_SIZE; i++)
+    {
+        uint8_t bucket = dictionary[i][0] - 32;
+        if(bucketEnd[bucket] == 0)
+        {
+            bucketStart[bucket] = i;
+        }
+        bucketEnd[bucket] = i + 1;
+    }
+    bucketsReady = 1;
+}
+
+//returns the compressed length, or -1 if the result would not fit in capacity
+int compressText(const uint8_t* input, uint16_t length, uint8_t* output, uint16_t capacity)
+{
+    uint32_t startCycles = cycleCounterNow();
+    uint16_t in = 0;
+    uint16_t out = 0;
+
+    if(!bucketsReady)
+    {
+        buildBuckets();
+    }
+
+    while(in < length)
+    {
+        uint8_t c = input[in];
+        int best = -1;
+        uint8_t bestLength = 0;
+
+        //greedy longest match among the fragments sharing the first character
+        if(c >= 32 && c < 128)
+        {
+            for(uint8_t i = bucketStart[c - 32]; i < bucketEnd[c - 32]; i++)
+            {
+                const char* word = dictionary[i];
+                uint8_t n = 1;
+                while(word[n] != '\0' && in + n < length && input[in + n] == (uint8_t)word[n])
+                {
+                    n++;
+                }
+                if(word[n] == '\0')
+                {
+                    best = i;
+                    bestLength = n;
+                    break;
+                }
+            }
+        }
+
+        if(best >= 0)
+        {
+            if(out + 1 > capacity)
+            {
+                return -1;
+            }
+            output[out++] = COMPRESS_CODE_FIRST + best;
+            in += bestLength;
+        }
+        else if(c >= COMPRESS_CODE_FIRST)
+        {
+            if(out + 2 > capacity)
+            {
+                return -1;
+            }
+            output[out++] = COMPRESS_CODE_LITERAL;
+            output[out++] = c;
+            in++;
+        }
+        else
+        {
+            if(out + 1 > capacity)
+            {
+                return -1;
+            }
+            output[out++] = c;
+            in++;
+        }
+    }
+
+    compressionStats.entriesCompressed++;
+    compressionStats.bytesIn += length;
+    compressionStats.bytesOut += out;
+    compressionStats.compressCycles += cycleCounterNow() - startCycles;
+    return out;
+}
+
+//expands one chunk of a compressed stream, a literal escape at the end of a chunk is carried in *escaped
+//returns the expanded length, or -1 if the output would not fit in capacity
+int expandTextChunk(uint8_t* escaped, const uint8_t* input, uint16_t length, uint8_t* output, uint16_t capacity)
+{
+    uint32_t startCycles = cycleCounterNow();
+    uint16_t out = 0;
+
+    for(uint16_t in = 0; in < length; in++)
+    {
+        uint8_t c = input[in];
+
+        if(*escaped || c < COMPRESS_CODE_FIRST)
+        {
+            if(out + 1 > capacity)
+            {
+                return -1;
+            }
+            output[out++] = c;
+            *escaped = 0;
+        }
+        else if(c == COMPRESS_CODE_LITERAL)
+        {
+            *escaped = 1;
+        }
+        else
+        {
+            const char* word = dictionary[c - COMPRESS_CODE_FIRST];
+            while(*word)
+            {
+                if(out + 1 > capacity)
+                {
+                    return -1;
+                }
+                output[out++] = *word++;
+            }
+        }
+    }
+
+    compressionStats.bytesDecompressed += out;
+    compressionStats.decompressCycles += cycleCounterNow() - startCycles;
+    return out;
+}
+
+//returns the decompressed length, or -1 if the input is malformed or the output would not fit
+int decompressText(const uint8_t* input, uint16_t length, uint8_t* output, uint16_t capacity)
+{
+    uint8_t escaped = 0;
+    int out = expandTextChunk(&escaped, input, length, output, capacity);
+    //an escape with no literal after it
+    return escaped ? -1 : out;
+}
+
+void getCompressionStats(CompressionStats* stats)
+{
+    *stats = compressionStats;
+}
@@ -1,21 +1,148 @@
 /*
-This module implements simple XOR encryption/decryption logic
+This module encrypts diary content with Speck64/128 in counter mode.
+Speck only needs 32 bit add, rotate and xor, which the Cortex-M0 does in single instructions.
+Each entry has its own nonce, the keystream block for byte n of an entry is E(nonce, n / 8),
+so any window of an entry can be encrypted or decrypted on its own. The nonce is the entry's
+sequence number, which the storage layer never hands out twice.
 */
 
 #include "crypto.h"
-void xorEncrypt(uint8_t* data, uint16_t length, uint8_t key) 
+#include "cycleCounter.h"
+#include <string.h>
+
+#define ROR(x, r) (((x) >> (r)) | ((x) << (32 - (r))))
+#define ROL(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+//round keys for the session key, expanded once at login
+static uint32_t sessionRoundKeys[CRYPTO_ROUNDS];
+static CryptoStats cryptoStats;
+
+static void speckExpandKey(const uint32_t key[CRYPTO_KEY_WORDS], uint32_t roundKeys[CRYPTO_ROUNDS])
+{
+    uint32_t k = key[0];
+    uint32_t l[3] = { key[1], key[2], key[3] };
+
+    roundKeys[0] = k;
+    for(uint32_t i = 0; i < CRYPTO_ROUNDS - 1; i++)
+    {
+        uint32_t next = (k + ROR(l[i % 3], 8)) ^ i;
+        l[i % 3] = next;
+        k = ROL(k, 3) ^ next;
+        roundKeys[i + 1] = k;
+    }
+}
+
+static void speckEncryptBlock(const uint32_t roundKeys[CRYPTO_ROUNDS], uint32_t* x, uint32_t* y)
 {
-    for(uint16_t i = 0; i < length; i++) 
+    uint32_t a = *x;
+    uint32_t b = *y;
+    for(int i = 0; i < CRYPTO_ROUNDS; i++)
     {
-        //xor each bit
-        data[i] ^= key;
-        //rotate the key right by 3 bits
-        key = (key >> 3) | (key << 5);
+        a = (ROR(a, 8) + b) ^ roundKeys[i];
+        b = ROL(b, 3) ^ a;
     }
+    *x = a;
+    *y = b;
 }
 
-//the decryption is the exact same as the ecryption process because the XOR operation is symmetric
-void xorDecrypt(uint8_t* data, uint16_t length, uint8_t key) 
+void cryptoSetKey(const uint32_t key[CRYPTO_KEY_WORDS])
 {
-    xorEncrypt(data, length, key); 
-}
\ No newline at end of file
+    speckExpandKey(key, sessionRoundKeys);
+}
+
+//stretches the password into the session key (Davies-Meyer over Speck, password blocks as keys)
+void cryptoDeriveSessionKey(const char* password)
+{
+    uint32_t state[CRYPTO_KEY_WORDS] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a };
+    uint32_t roundKeys[CRYPTO_ROUNDS];
+    uint16_t length = strlen(password);
+
+    for(uint32_t iteration = 0; iteration < CRYPTO_KDF_ITERATIONS; iteration++)
+    {
+        //every chunk is absorbed, including an empty final chunk that carries the length
+        for(uint16_t offset = 0; offset <= length; offset += 16)
+        {
+            uint8_t chunk[16] = { 0 };
+            uint16_t take = (length - offset < 16) ? length - offset : 16;
+            memcpy(chunk, password + offset, take);
+            if(take < 16)
+            {
+                chunk[15] = length;
+            }
+
+            uint32_t block[CRYPTO_KEY_WORDS];
+            memcpy(block, chunk, sizeof(block));
+            block[0] ^= iteration;
+            speckExpandKey(block, roundKeys);
+
+            for(int half = 0; half < CRYPTO_KEY_WORDS; half += 2)
+            {
+                uint32_t x = state[half];
+                uint32_t y = state[half + 1];
+                speckEncryptBlock(roundKeys, &x, &y);
+                state[half] ^= x;
+                state[half + 1] ^= y;
+            }
+        }
+    }
+    cryptoSetKey(state);
+    memset(state, 0, sizeof(state));
+    memset(roundKeys, 0, sizeof(roundKeys));
+}
+
+//xors the keystream for bytes [offset, offset + length) of an entry into data
+static void applyKeystream(uint8_t* data, uint16_t length, uint32_t nonce, uint32_t offset)
+{
+    while(length > 0)
+    {
+        uint32_t words[2] = { nonce, offset / CRYPTO_BLOCK_BYTES };
+        speckEncryptBlock(sessionRoundKeys, &words[0], &words[1]);
+
+        uint16_t start = offset % CRYPTO_BLOCK_BYTES;
+        uint16_t take = CRYPTO_BLOCK_BYTES - start;
+        if(take > length)
+        {
+            take = length;
+        }
+
+        if(take == CRYPTO_BLOCK_BYTES && ((uintptr_t)data & 3) == 0)
+        {
+            //whole aligned block, two word xors
+            ((uint32_t*)data)[0] ^= words[0];
+            ((uint32_t*)data)[1] ^= words[1];
+        }
+        else
+        {
+            const uint8_t* keystream = (const uint8_t*)words;
+            for(uint16_t i = 0; i < take; i++)
+            {
+                data[i] ^= keystream[start + i];
+            }
+        }
+
+        data += take;
+        offset += take;
+        length -= take;
+    }
+}
+
+void cryptoEncrypt(uint8_t* data, uint16_t length, uint32_t nonce, uint32_t offset)
+{
+    uint32_t startCycles = cycleCounterNow();
+    applyKeystream(data, length, nonce, offset);
+    cryptoStats.bytesEncrypted += length;
+    cryptoStats.encryptCycles += cycleCounterNow() - startCycles;
+}
+
+void cryptoDecrypt(uint8_t* data, uint16_t length, uint32_t nonce, uint32_t offset)
+{
+    uint32_t startCycles = cycleCounterNow();
+    applyKeystream(data, length, nonce, offset);
+    cryptoStats.bytesDecrypted += length;
+    cryptoStats.decryptCycles += cycleCounterNow() - startCycles;
+}
+
+void cryptoGetStats(CryptoStats* stats)
+{
+    *stats = cryptoStats;
+}
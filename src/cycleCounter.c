@@ -0,0 +1,46 @@
+/*
+This module provides a free-running cycle counter for timing code, using TIM2 as a 32 bit counter at the core clock.
+The Cortex-M0 has no DWT cycle counter, and TIM2 needs no interrupt. It wraps after about 89 seconds.
+On host builds the counter is derived from the monotonic clock, scaled to the same 48MHz rate.
+*/
+
+#include "cycleCounter.h"
+
+#ifndef HOST_BUILD
+
+#include "stm32f0xx.h"
+
+void cycleCounterInit(void)
+{
+    RCC->APB1ENR |= RCC_APB1ENR_TIM2EN;
+    TIM2->CR1 &= ~TIM_CR1_CEN;
+    //no prescaler and the full 32 bit range
+    TIM2->PSC = 0;
+    TIM2->ARR = 0xFFFFFFFF;
+    TIM2->EGR = TIM_EGR_UG;
+    TIM2->CR1 |= TIM_CR1_CEN;
+}
+
+//from SRAM, interrupt handlers use it while the flash is busy
+RAMFUNC uint32_t cycleCounterNow(void)
+{
+    return TIM2->CNT;
+}
+
+#else
+
+#include <time.h>
+
+void cycleCounterInit(void)
+{
+}
+
+uint32_t cycleCounterNow(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    return (uint32_t)(ns * (CYCLES_PER_MS / 1000) / 1000);
+}
+
+#endif
@@ -1,230 +1,1600 @@
 /*
 This module manages the diary entries in the EEPROM and handles storage and retrieval operations.
+Each entry is a record slot followed by its content extents, always inside one storage page.
+Pages are recycled by copying their live entries to the page being filled, see storage.c.
+A page is closed with a checkpoint listing its records, so mounting reads a few halfwords per
+entry instead of every slot of every page.
 */
-#include <stdio.h>
 #include "stm32f0xx.h" 
 #include "diary.h"
+#include "format.h"
 #include "eepromDriver.h"
+#include "storage.h"
 #include "crypto.h"
+#include "compress.h"
 #include "rtc.h"
+#include "cycleCounter.h"
+#include "opStats.h"
 #include <string.h>
-#include "stm32f0xx.h"
+#include <stddef.h>
 
-#define INDEX_TABLE_ADDRESS FLASH_PAGE_62_ADDRESS
-#define CONTENT_START_ADDRESS (FLASH_PAGE_62_ADDRESS + 0x200)
-#define DEBUG_SEARCH 1
+#define DEBUG_SEARCH 0
 
+_Static_assert(sizeof(DiaryEntryIndex) == STORAGE_SLOT_SIZE, "a record has to fill exactly one slot");
+_Static_assert(sizeof(PageCheckpoint) <= STORAGE_SUMMARY_SLOTS * STORAGE_SLOT_SIZE, "page checkpoint does not fit the summary slots");
+
+//bloom filter over the tags in the index, two bits per tag
+#define TAG_BLOOM_BITS 256
+
+//RAM index: the record slot of every entry in the order they were written, kept in sync by every store/delete
+static uint16_t entrySlots[MAX_ENTRIES];
+static int cachedCount = 0;
+static int cachedDeleted = 0;
+static uint8_t cacheLoaded = 0;
+static IndexCacheStats cacheStats;
+static DiaryWriteStats writeStats;
+static DiaryCompactionStats compactionStats;
+static DiaryMountStats mountStats;
+//page holding the entry being written, compaction must not recycle it
+static uint16_t openWritePage = STORAGE_NO_PAGE;
+//set when compaction could not make room, cleared once a delete frees something
+static uint8_t compactionStalled = 0;
+
+//background compaction empties one victim page an entry at a time, copying one extent per unit
+//the copy's record and extent slots are taken up front so foreground writes can follow it in the page
+typedef struct
+{
+    uint16_t victim;                //page being emptied, STORAGE_NO_PAGE when idle
+    uint16_t nextSlot;              //next victim slot to look for a record in
+    uint16_t source;                //record slot of the entry being copied, STORAGE_NO_SLOT if none
+    uint16_t target;                //record slot taken for the copy, its extents follow it
+    uint16_t extents;
+    uint16_t copied;                //extents already programmed
+} CompactionJob;
+
+static CompactionJob compactionJob = { STORAGE_NO_PAGE, 0, STORAGE_NO_SLOT, 0, 0, 0 };
+
+//16 bit tag hashes kept alongside the index, plus a bloom filter for quick misses
+//entries dropped by compaction leave their bloom bits behind, which only costs a false positive
+static uint16_t tagHashes[MAX_ENTRIES];
+static uint8_t tagBloom[TAG_BLOOM_BITS / 8];
+
+//FNV-1a over the tag as stored (at most MAX_TAG_LENGTH-1 chars)
+static uint32_t hashTag(const char* tag)
+{
+    uint32_t hash = 2166136261u;
+    for(int i = 0; i < MAX_TAG_LENGTH - 1 && tag[i] != '\0'; i++)
+    {
+        hash ^= (uint8_t)tag[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint16_t foldTagHash(uint32_t hash)
+{
+    return (uint16_t)(hash ^ (hash >> 16));
+}
+
+static uint16_t tagHashOf(const char* tag)
+{
+    return foldTagHash(hashTag(tag));
+}
+
+//both bloom bits come from the folded hash, so a checkpoint can rebuild the filter without the tag
+static void bloomAdd(uint16_t hash)
+{
+    uint8_t bit1 = hash & 0xFF;
+    uint8_t bit2 = hash >> 8;
+    tagBloom[bit1 >> 3] |= 1 << (bit1 & 7);
+    tagBloom[bit2 >> 3] |= 1 << (bit2 & 7);
+}
+
+static int bloomMayContain(uint16_t hash)
+{
+    uint8_t bit1 = hash & 0xFF;
+    uint8_t bit2 = hash >> 8;
+    return (tagBloom[bit1 >> 3] & (1 << (bit1 & 7))) && (tagBloom[bit2 >> 3] & (1 << (bit2 & 7)));
+}
+
+//records are read in place through the memory-mapped flash
+static const DiaryEntryIndex* recordAt(uint16_t slot)
+{
+    return (const DiaryEntryIndex*)eepromView(STORAGE_SLOT_ADDRESS(slot) - STORAGE_BASE_ADDRESS, sizeof(DiaryEntryIndex));
+}
+
+//reads just the sequence of a record
+static uint32_t sequenceAt(uint16_t slot)
+{
+    const uint32_t* sequence = (const uint32_t*)eepromView(STORAGE_SLOT_ADDRESS(slot) + offsetof(DiaryEntryIndex, sequence) - STORAGE_BASE_ADDRESS, sizeof(uint32_t));
+    return *sequence;
+}
+
+//CRC-16/CCITT over everything after the crc field, a bit at a time since a record is only 28 bytes
+static uint16_t recordCrc(const DiaryEntryIndex* record)
+{
+    const uint8_t* bytes = (const uint8_t*)record + offsetof(DiaryEntryIndex, length);
+    uint16_t crc = 0xFFFF;
+    for(uint16_t i = 0; i < sizeof(DiaryEntryIndex) - offsetof(DiaryEntryIndex, length); i++)
+    {
+        crc ^= bytes[i] << 8;
+        for(int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+//records the tag of an indexed entry in the hash table and bloom filter
+static void indexTag(int index, uint16_t tagHash)
+{
+    tagHashes[index] = tagHash;
+    bloomAdd(tagHash);
+}
+
+//extents needed for length content bytes, every entry has at least one
+static uint16_t extentsFor(uint16_t length)
+{
+    return (length == 0) ? 1 : (length + EXTENT_PAYLOAD - 1) / EXTENT_PAYLOAD;
+}
+
+//1 if the record at slot is intact and its extents are inside the written part of its page
+//a tombstone changed the flags after the CRC was taken, so only its extents are checked
+static int recordValid(const DiaryEntryIndex* record, uint16_t slot, uint16_t pageEnd)
+{
+    if(record->length > MAX_ENTRY_LENGTH || RECORD_FIRST_EXTENT(slot) + extentsFor(record->length) > pageEnd)
+    {
+        return 0;
+    }
+    return ENTRY_IS_DELETED(record) || record->crc == recordCrc(record);
+}
+
+//appends a record to the index, returns the slots it keeps live (none for a tombstone)
+static uint16_t indexRecord(uint16_t slot, uint16_t flags, uint16_t extents, uint16_t tagHash)
+{
+    if(cachedCount >= MAX_ENTRIES)
+    {
+        FormatBuffer* line = formatBegin();
+        formatText(line, "\r\nWARNING: Index full, entry at slot ");
+        formatUnsigned(line, slot, 0, ' ');
+        formatText(line, " not loaded");
+        formatSend(line);
+        return 0;
+    }
+    entrySlots[cachedCount] = slot;
+    indexTag(cachedCount, tagHash);
+    cachedCount++;
+    if(flags == ENTRY_FLAGS_DELETED)
+    {
+        cachedDeleted++;
+        return 0;
+    }
+    return 1 + extents;
+}
+
+//indexes a page by reading every written slot, returns the slots holding live entries
+static uint16_t scanPageRecords(uint16_t page)
+{
+    uint16_t first = page * STORAGE_SLOTS_PER_PAGE;
+    uint16_t end = first + storagePageFill(page);
+    uint16_t committedEnd = first + STORAGE_FIRST_DATA_SLOT;
+    uint16_t live = 0;
+
+    for(uint16_t slot = first + STORAGE_FIRST_DATA_SLOT; slot < end; slot++)
+    {
+        //extents and records of a write that never committed are skipped, recovery needs nothing else
+        const DiaryEntryIndex* record = recordAt(slot);
+        cacheStats.recordReads++;
+        if(record->marker != RECORD_MARKER && record->marker != RECORD_MOVED)
+        {
+            continue;
+        }
+        if(!recordValid(record, slot, end))
+        {
+            mountStats.invalidRecords += (record->marker == RECORD_MARKER);
+            continue;
+        }
+        committedEnd = RECORD_FIRST_EXTENT(slot) + extentsFor(record->length);
+        if(record->marker == RECORD_MARKER)
+        {
+            live += indexRecord(slot, record->flags, extentsFor(record->length), tagHashOf(record->tag));
+        }
+    }
+
+    if(page == storageActivePage() && end > committedEnd)
+    {
+        mountStats.uncommittedSlots = end - committedEnd;
+    }
+    return live;
+}
+
+#if DIARY_CHECKPOINTS
+
+//the checkpoint of a page, NULL if it is missing, not committed, or the page was written after it
+static const PageCheckpoint* pageCheckpoint(uint16_t page)
+{
+    const PageCheckpoint* checkpoint = (const PageCheckpoint*)eepromView(STORAGE_SUMMARY_ADDRESS(page) - STORAGE_BASE_ADDRESS, sizeof(PageCheckpoint));
+    uint16_t fill = storagePageFill(page);
+    if(!checkpoint || checkpoint->commit != CHECKPOINT_COMMIT || checkpoint->fill != fill || checkpoint->count > CHECKPOINT_MAX_RECORDS)
+    {
+        return NULL;
+    }
+    for(int i = 0; i < checkpoint->count; i++)
+    {
+        if(checkpoint->records[i].slot < STORAGE_FIRST_DATA_SLOT || checkpoint->records[i].slot + 1 + checkpoint->records[i].extents > fill)
+        {
+            return NULL;
+        }
+    }
+    return checkpoint;
+}
+
+//indexes a page from its checkpoint, returns the slots holding live entries or -1 if it has no usable one
+static int loadPageCheckpoint(uint16_t page)
+{
+    const PageCheckpoint* checkpoint = pageCheckpoint(page);
+    if(!checkpoint)
+    {
+        return -1;
+    }
+
+    uint16_t first = page * STORAGE_SLOTS_PER_PAGE;
+    uint16_t live = 0;
+    for(int i = 0; i < checkpoint->count; i++)
+    {
+        //only the marker and the flags can change once a page is closed
+        uint16_t slot = first + checkpoint->records[i].slot;
+        uint32_t address = STORAGE_SLOT_ADDRESS(slot);
+        if(flashReadHalfword(address) != RECORD_MARKER)
+        {
+            continue;
+        }
+        uint16_t flags = flashReadHalfword(address + offsetof(DiaryEntryIndex, flags));
+        live += indexRecord(slot, flags, checkpoint->records[i].extents, checkpoint->records[i].tagHash);
+    }
+    mountStats.checkpointPages++;
+    return live;
+}
+
+//programs the checkpoint of a page that is about to be closed, the commit halfword goes last
+//a page that already has one (it was reopened after a reset) is left to the slot scan
+static void writePageCheckpoint(uint16_t page)
+{
+    PageCheckpoint checkpoint;
+    memset(&checkpoint, 0xFF, sizeof(checkpoint));
+    uint16_t first = page * STORAGE_SLOTS_PER_PAGE;
+    uint16_t end = first + storagePageFill(page);
+    checkpoint.count = 0;
+    checkpoint.fill = storagePageFill(page);
+
+    for(uint16_t slot = first + STORAGE_FIRST_DATA_SLOT; slot < end && checkpoint.count < CHECKPOINT_MAX_RECORDS; slot++)
+    {
+        const DiaryEntryIndex* record = recordAt(slot);
+        if(record->marker != RECORD_MARKER || !recordValid(record, slot, end))
+        {
+            continue;
+        }
+        checkpoint.records[checkpoint.count].slot = slot - first;
+        checkpoint.records[checkpoint.count].extents = extentsFor(record->length);
+        checkpoint.records[checkpoint.count].tagHash = tagHashOf(record->tag);
+        checkpoint.count++;
+    }
+
+    uint32_t address = STORAGE_SUMMARY_ADDRESS(page);
+    if(flashProgram(address, (const uint8_t*)&checkpoint, offsetof(PageCheckpoint, commit), 0) != EEPROM_OK)
+    {
+        return;
+    }
+    uint16_t commit = CHECKPOINT_COMMIT;
+    flashProgram(address + offsetof(PageCheckpoint, commit), (const uint8_t*)&commit, sizeof(commit), 0);
+}
+
+#endif
+
+//gives up the entry copy in progress, the original is untouched and the job goes back to it
+static void abandonBackgroundCopy(void)
+{
+    if(compactionJob.source != STORAGE_NO_SLOT)
+    {
+        storageMarkDead(compactionJob.target, 1 + compactionJob.extents);
+        compactionJob.nextSlot = compactionJob.source;
+        compactionJob.source = STORAGE_NO_SLOT;
+    }
+}
+
+static void abandonBackgroundJob(void)
+{
+    abandonBackgroundCopy();
+    compactionJob.victim = STORAGE_NO_PAGE;
+}
+
+//closes the page being filled, with its checkpoint, and starts filling the least worn free page
+static uint16_t openNextPage(void)
+{
+    //the checkpoint lists committed records only, a half copied entry would be dead weight in it
+    abandonBackgroundCopy();
+    #if DIARY_CHECKPOINTS
+    uint16_t page = storageActivePage();
+    if(page != STORAGE_NO_PAGE && storageFreePageCount() > 0)
+    {
+        writePageCheckpoint(page);
+    }
+    #endif
+    return storageOpenPage();
+}
+
+//drops an index entry found twice, its slots are reclaimed with its page
+static void dropDuplicate(uint16_t slot)
+{
+    const DiaryEntryIndex* record = recordAt(slot);
+    if(ENTRY_IS_DELETED(record))
+    {
+        cachedDeleted--;
+    }
+    else
+    {
+        storageMarkDead(slot, 1 + extentsFor(record->length));
+    }
+    mountStats.duplicates++;
+}
+
+//puts the index back in write order, relocated entries sit in newer pages than entries written after them
+//a relocation interrupted before the old record was cleared leaves two copies with the same sequence, one is dropped
+static void sortIndexBySequence(void)
+{
+    int count = 0;
+    uint32_t lastSequence = 0;
+    for(int i = 0; i < cachedCount; i++)
+    {
+        uint16_t slot = entrySlots[i];
+        uint16_t tagHash = tagHashes[i];
+        uint32_t sequence = sequenceAt(slot);
+
+        //most entries are already in order and just stay where they are
+        int low = count;
+        if(count > 0 && sequence <= lastSequence)
+        {
+            int high = count;
+            low = 0;
+            while(low < high)
+            {
+                int middle = (low + high) / 2;
+                if(sequenceAt(entrySlots[middle]) < sequence)
+                {
+                    low = middle + 1;
+                }
+                else
+                {
+                    high = middle;
+                }
+            }
+            if(sequenceAt(entrySlots[low]) == sequence)
+            {
+                dropDuplicate(slot);
+                continue;
+            }
+            memmove(&entrySlots[low + 1], &entrySlots[low], (count - low) * sizeof(entrySlots[0]));
+            memmove(&tagHashes[low + 1], &tagHashes[low], (count - low) * sizeof(tagHashes[0]));
+        }
+        else
+        {
+            lastSequence = sequence;
+        }
+        entrySlots[low] = slot;
+        tagHashes[low] = tagHash;
+        count++;
+    }
+    cachedCount = count;
+}
+
+//walks every page in use, oldest first, and rebuilds the index and the page usage
+//closed pages are indexed from their checkpoint, the others by reading every written slot
+void loadIndexCache(void)
+{
+    uint32_t startCycles = cycleCounterNow();
+    uint16_t order[STORAGE_PAGE_COUNT];
+    cachedCount = 0;
+    cachedDeleted = 0;
+    memset(tagBloom, 0, sizeof(tagBloom));
+    memset(&mountStats, 0, sizeof(mountStats));
+
+    storageScanPages();
+    int pages = storagePagesInOrder(order);
+    for(int p = 0; p < pages; p++)
+    {
+        int live = -1;
+        #if DIARY_CHECKPOINTS
+        live = loadPageCheckpoint(order[p]);
+        #endif
+        if(live < 0)
+        {
+            live = scanPageRecords(order[p]);
+        }
+
+        //whatever is written but not part of a live entry can be reclaimed
+        uint16_t first = order[p] * STORAGE_SLOTS_PER_PAGE;
+        storageMarkDead(first, storagePageFill(order[p]) - STORAGE_FIRST_DATA_SLOT - live);
+    }
+    sortIndexBySequence();
+
+    cacheLoaded = 1;
+    compactionStalled = 0;
+    compactionJob.victim = STORAGE_NO_PAGE;
+    compactionJob.source = STORAGE_NO_SLOT;
+    cacheStats.loads++;
+    mountStats.pages = pages;
+    mountStats.entries = cachedCount;
+    mountStats.cycles = cycleCounterNow() - startCycles;
+}
+
+//rebuilds the RAM state from what is already in flash, returns the number of entries found
+//a write that was in progress did not survive the reset, its slots are dead space like any uncommitted tail
+int mountDiary(void)
+{
+    openWritePage = STORAGE_NO_PAGE;
+    loadIndexCache();
+    return cachedCount;
+}
+
+void getDiaryMountStats(DiaryMountStats* stats)
+{
+    *stats = mountStats;
+}
+
+//forces the next lookup to rescan flash
+void invalidateIndexCache(void)
+{
+    cacheLoaded = 0;
+}
+
+static void ensureIndexCache(void)
+{
+    if(!cacheLoaded)
+    {
+        loadIndexCache();
+    }
+}
+
+//erases the whole storage region, every page keeps its erase count
+//only done on request, a normal start mounts what is there with mountDiary
+int formatDiary(void)
+{
+    int result = storageFormat();
+    loadIndexCache();
+    return result;
+}
+
+//returns the entry's record, or NULL if the index is past the end of the index
+const DiaryEntryIndex* getCachedEntry(uint16_t index)
+{
+    ensureIndexCache();
+    if(index >= cachedCount)
+    {
+        return NULL;
+    }
+    //the RAM index goes straight to the record instead of scanning for it
+    cacheStats.recordReadsAvoided++;
+    return recordAt(entrySlots[index]);
+}
+
+//flash address of an entry's record, 0 if the index is past the end of the index
+uint32_t getEntryAddress(uint16_t index)
+{
+    ensureIndexCache();
+    return (index < cachedCount) ? STORAGE_SLOT_ADDRESS(entrySlots[index]) : 0;
+}
+
+void getIndexCacheStats(IndexCacheStats* stats)
+{
+    *stats = cacheStats;
+}
+
+void getDiaryCompactionStats(DiaryCompactionStats* stats)
+{
+    *stats = compactionStats;
+}
+
+//address of the next slot to be written, or STORAGE_END_ADDRESS if a new page has to be opened first
 uint32_t findNextFreeAddress() 
 {
-    int count = getEntryCount();
-    uint32_t highestUsed = CONTENT_START_ADDRESS;
-    
-    //find the highest used address
-    for(int i = 0; i < count; i++) 
+    ensureIndexCache();
+    uint16_t page = storageActivePage();
+    if(storageSlotsLeft() == 0)
+    {
+        return STORAGE_END_ADDRESS;
+    }
+    return STORAGE_SLOT_ADDRESS((page + 1) * STORAGE_SLOTS_PER_PAGE - storageSlotsLeft());
+}
+
+static void openReader(DiaryReader* reader, uint16_t slot, const DiaryEntryIndex* meta, uint8_t decrypt)
+{
+    reader->nonce = meta->sequence;
+    reader->length = meta->length;
+    reader->offset = 0;
+    reader->address = EXTENT_ADDRESS(RECORD_FIRST_EXTENT(slot)) + EXTENT_HEADER_SIZE;
+    reader->extentEnd = EXTENT_ADDRESS(RECORD_FIRST_EXTENT(slot)) + EXTENT_SIZE;
+    reader->decrypt = decrypt;
+}
+
+//programs a record with its marker still erased and then the marker by itself, which commits it
+//a reset anywhere before the last halfword leaves a record the mount does not see
+static int programRecord(uint16_t slot, const DiaryEntryIndex* meta)
+{
+    DiaryEntryIndex body = *meta;
+    body.marker = 0xFFFF;
+    int result = flashProgram(STORAGE_SLOT_ADDRESS(slot), (const uint8_t*)&body, sizeof(body), 0);
+    if(result != EEPROM_OK)
+    {
+        return result;
+    }
+    uint16_t marker = RECORD_MARKER;
+    return flashProgram(STORAGE_SLOT_ADDRESS(slot), (const uint8_t*)&marker, sizeof(marker), 0);
+}
+
+//copies one extent into a slot already taken, linking it to the slot after it unless it is the last
+static int copyExtent(uint16_t source, uint16_t target, uint8_t last)
+{
+    //ciphertext is copied as it is, it stays valid since its offsets in the entry do not change
+    uint8_t extent[EXTENT_SIZE];
+    if(eepromRead(EXTENT_ADDRESS(source) - STORAGE_BASE_ADDRESS, extent, EXTENT_SIZE) != EEPROM_OK)
+    {
+        return EEPROM_ERROR;
+    }
+    uint16_t link = last ? EXTENT_NONE : target + 1;
+    memcpy(extent, &link, sizeof(link));
+    return flashProgram(EXTENT_ADDRESS(target), extent, EXTENT_SIZE, 0);
+}
+
+//copies count extents starting at source into freshly taken slots, relinking them as a new chain
+//the last copy keeps an erased link, returns the first new slot or EXTENT_NONE
+static uint16_t copyExtents(uint16_t source, uint16_t count)
+{
+    uint16_t first = EXTENT_NONE;
+    for(uint16_t i = 0; i < count; i++)
+    {
+        uint16_t slot = storageTakeSlot();
+        if(slot == STORAGE_NO_SLOT)
+        {
+            return EXTENT_NONE;
+        }
+        if(i == 0)
+        {
+            first = slot;
+        }
+        if(copyExtent(source + i, slot, i + 1 == count) != EEPROM_OK)
+        {
+            return EXTENT_NONE;
+        }
+    }
+    return first;
+}
+
+//commits a copy whose extents are all in place and retires the original record
+static int commitRelocation(int index, uint16_t slot, uint16_t extents)
+{
+    if(programRecord(slot, recordAt(entrySlots[index])) != EEPROM_OK)
+    {
+        return EEPROM_ERROR;
+    }
+    //the old record stops being a record, a reset before this is caught by the mount as a duplicate sequence
+    uint16_t moved = RECORD_MOVED;
+    flashProgram(STORAGE_SLOT_ADDRESS(entrySlots[index]), (const uint8_t*)&moved, sizeof(moved), 0);
+    entrySlots[index] = slot;
+    compactionStats.entriesMoved++;
+    compactionStats.slotsMoved += 1 + extents;
+    return EEPROM_OK;
+}
+
+//copies a live entry to the page being filled and points the index at the copy
+static int relocateEntry(int index)
+{
+    const DiaryEntryIndex* old = recordAt(entrySlots[index]);
+    uint16_t extents = extentsFor(old->length);
+    if(storageSlotsLeft() < 1 + extents && openNextPage() == STORAGE_NO_PAGE)
+    {
+        return EEPROM_ERROR;
+    }
+
+    //the copy keeps the sequence, so it keeps its place in the index and its keystream
+    uint16_t slot = storageTakeSlot();
+    if(copyExtents(RECORD_FIRST_EXTENT(entrySlots[index]), extents) == EXTENT_NONE)
+    {
+        return EEPROM_ERROR;
+    }
+    return commitRelocation(index, slot, extents);
+}
+
+//drops an index entry whose record is about to be erased
+static void forgetEntry(int index)
+{
+    memmove(&entrySlots[index], &entrySlots[index + 1], (cachedCount - index - 1) * sizeof(entrySlots[0]));
+    memmove(&tagHashes[index], &tagHashes[index + 1], (cachedCount - index - 1) * sizeof(tagHashes[0]));
+    cachedCount--;
+    cachedDeleted--;
+}
+
+//index position of the entry whose record is in the slot, -1 if it is not indexed
+static int indexOfSlot(uint16_t slot)
+{
+    for(int index = 0; index < cachedCount; index++)
+    {
+        if(entrySlots[index] == slot)
+        {
+            return index;
+        }
+    }
+    return -1;
+}
+
+//moves the live entries out of a page and erases it, tombstoned entries go with the erase
+static int recyclePage(uint16_t page)
+{
+    //foreground compaction takes over, the background job would only be in its way
+    abandonBackgroundJob();
+
+    uint16_t first = page * STORAGE_SLOTS_PER_PAGE;
+    uint16_t fill = storagePageFill(page);
+
+    for(uint16_t slot = first + STORAGE_FIRST_DATA_SLOT; slot < first + fill; slot++)
+    {
+        if(recordAt(slot)->marker != RECORD_MARKER)
+        {
+            continue;
+        }
+        int index = indexOfSlot(slot);
+        if(index < 0)
+        {
+            //not indexed (the index was full at load), nothing to keep
+            continue;
+        }
+        if(ENTRY_IS_DELETED(recordAt(slot)))
+        {
+            forgetEntry(index);
+        }
+        else if(relocateEntry(index) != EEPROM_OK)
+        {
+            return EEPROM_ERROR;
+        }
+    }
+
+    compactionStats.pagesRecycled++;
+    return storageRecyclePage(page);
+}
+
+//recycles the dirtiest pages until more than the reserve is free, or nothing is left to gain
+//dead slots scattered in gaps too small for any entry can make every recycle just move entries around,
+//so a pass recycles each page at most once and a pass that frees nothing is not retried until a delete
+static void compactStorage(uint16_t needed)
+{
+    if(compactionStalled)
+    {
+        return;
+    }
+    for(uint16_t round = 0; round < STORAGE_PAGE_COUNT && storageFreePageCount() <= STORAGE_RESERVE_PAGES; round++)
+    {
+        uint16_t freeBefore = storageFreePageCount();
+        uint16_t victim = storagePickVictim(openWritePage);
+        if(victim == STORAGE_NO_PAGE || recyclePage(victim) != EEPROM_OK)
+        {
+            break;
+        }
+        //no page came back, but the page being filled may have room for the entry now
+        if(storageFreePageCount() <= freeBefore && storageSlotsLeft() >= needed)
+        {
+            return;
+        }
+    }
+    compactionStalled = storageFreePageCount() <= STORAGE_RESERVE_PAGES && storageSlotsLeft() < needed;
+}
+
+//outcome of one unit of background compaction
+#define GC_IDLE 0
+#define GC_MORE 1
+#define GC_YIELD 2
+
+//reserves room for a copy of the entry in the victim slot, the copy is done one extent per unit
+static int startBackgroundCopy(uint16_t slot)
+{
+    //the reserve page is left to foreground compaction, writes could fill it before the victim is erased
+    uint16_t extents = extentsFor(recordAt(slot)->length);
+    if(storageSlotsLeft() < 1 + extents && (storageFreePageCount() <= STORAGE_RESERVE_PAGES || openNextPage() == STORAGE_NO_PAGE))
+    {
+        abandonBackgroundJob();
+        return GC_IDLE;
+    }
+    compactionJob.target = storageTakeSlot();
+    for(uint16_t i = 0; i < extents; i++)
+    {
+        storageTakeSlot();
+    }
+    compactionJob.source = slot;
+    compactionJob.extents = extents;
+    compactionJob.copied = 0;
+    return GC_MORE;
+}
+
+static int continueBackgroundCopy(void)
+{
+    if(compactionJob.copied < compactionJob.extents)
+    {
+        uint16_t i = compactionJob.copied;
+        uint8_t last = i + 1 == compactionJob.extents;
+        if(copyExtent(RECORD_FIRST_EXTENT(compactionJob.source) + i, RECORD_FIRST_EXTENT(compactionJob.target) + i, last) != EEPROM_OK)
+        {
+            abandonBackgroundJob();
+            return GC_IDLE;
+        }
+        compactionJob.copied++;
+        return GC_MORE;
+    }
+
+    //the entry may have been deleted between units, then the copy is dropped instead of committed
+    int index = indexOfSlot(compactionJob.source);
+    if(index < 0 || ENTRY_IS_DELETED(recordAt(compactionJob.source)))
+    {
+        if(index >= 0)
+        {
+            forgetEntry(index);
+        }
+        abandonBackgroundCopy();
+        return GC_MORE;
+    }
+    if(commitRelocation(index, compactionJob.target, compactionJob.extents) != EEPROM_OK)
+    {
+        abandonBackgroundJob();
+        return GC_IDLE;
+    }
+    compactionStats.backgroundSlotsMoved += 1 + compactionJob.extents;
+    compactionJob.source = STORAGE_NO_SLOT;
+    return GC_MORE;
+}
+
+//does one unit of background compaction, firstUnit tells whether the step has spent any time yet
+static int backgroundUnit(uint8_t firstUnit)
+{
+    if(compactionJob.victim == STORAGE_NO_PAGE)
+    {
+        if(compactionStalled || storageFreePageCount() >= DIARY_GC_FREE_PAGES)
+        {
+            return GC_IDLE;
+        }
+        uint16_t victim = storagePickVictim(STORAGE_NO_PAGE);
+        if(victim == STORAGE_NO_PAGE || storagePageDead(victim) < DIARY_GC_MIN_DEAD_SLOTS)
+        {
+            return GC_IDLE;
+        }
+        compactionJob.victim = victim;
+        compactionJob.nextSlot = victim * STORAGE_SLOTS_PER_PAGE + STORAGE_FIRST_DATA_SLOT;
+        compactionJob.source = STORAGE_NO_SLOT;
+    }
+
+    if(compactionJob.source != STORAGE_NO_SLOT)
+    {
+        return continueBackgroundCopy();
+    }
+
+    uint16_t end = compactionJob.victim * STORAGE_SLOTS_PER_PAGE + storagePageFill(compactionJob.victim);
+    while(compactionJob.nextSlot < end)
+    {
+        uint16_t slot = compactionJob.nextSlot++;
+        if(recordAt(slot)->marker != RECORD_MARKER)
+        {
+            continue;
+        }
+        int index = indexOfSlot(slot);
+        if(index < 0)
+        {
+            continue;
+        }
+        if(ENTRY_IS_DELETED(recordAt(slot)))
+        {
+            forgetEntry(index);
+            continue;
+        }
+        return startBackgroundCopy(slot);
+    }
+
+    //nothing live is left, the erase gets a step of its own
+    if(!firstUnit)
+    {
+        return GC_YIELD;
+    }
+    uint16_t victim = compactionJob.victim;
+    compactionJob.victim = STORAGE_NO_PAGE;
+    if(storageRecyclePage(victim) != EEPROM_OK)
+    {
+        return GC_IDLE;
+    }
+    compactionStats.pagesRecycled++;
+    compactionStats.backgroundPages++;
+    return GC_YIELD;
+}
+
+//runs background compaction until budgetCycles have passed, returns 0 once there is nothing left to do
+int diaryBackgroundStep(uint32_t budgetCycles)
+{
+    //nothing is moved before the index is loaded or while an entry is being written
+    if(!cacheLoaded || openWritePage != STORAGE_NO_PAGE)
+    {
+        return 0;
+    }
+
+    uint32_t startCycles = cycleCounterNow();
+    int result = backgroundUnit(1);
+    if(result == GC_IDLE)
+    {
+        return 0;
+    }
+    while(result == GC_MORE && cycleCounterNow() - startCycles < budgetCycles)
+    {
+        result = backgroundUnit(0);
+    }
+
+    uint32_t elapsed = cycleCounterNow() - startCycles;
+    compactionStats.backgroundSteps++;
+    if(elapsed > compactionStats.longestStepCycles)
+    {
+        compactionStats.longestStepCycles = elapsed;
+    }
+    return result != GC_IDLE;
+}
+
+//makes room for needed slots in the page being filled, opening a new page if it has to
+//compaction may have opened one already, a new entry never dips into the reserve
+static int openFreshPage(uint16_t needed)
+{
+    compactStorage(needed);
+    if(storageSlotsLeft() >= needed)
+    {
+        return EEPROM_OK;
+    }
+    if(storageFreePageCount() <= STORAGE_RESERVE_PAGES || openNextPage() == STORAGE_NO_PAGE)
+    {
+        formatPuts("\r\nERROR: Insufficient flash space!");
+        return EEPROM_ERROR;
+    }
+    return EEPROM_OK;
+}
+
+//an entry has to stay in one page, so one that outgrows its page is copied to a fresh one
+static int moveOpenEntry(DiaryWriter* writer)
+{
+    uint16_t written = EXTENT_OF(writer->extentEnd - 1) - writer->firstExtent + 1;
+    uint16_t oldRecord = writer->slot;
+    if(written + 2 > STORAGE_DATA_SLOTS_PER_PAGE || openFreshPage(written + 2) != EEPROM_OK)
+    {
+        return EEPROM_ERROR;
+    }
+
+    //the record slot is still blank, it is only programmed by finishDiaryWrite
+    uint16_t record = storageTakeSlot();
+    uint16_t first = copyExtents(writer->firstExtent, written);
+    if(first == EXTENT_NONE)
+    {
+        //the slots of a partial copy are dead, the writer keeps the original for abortDiaryWrite
+        storageMarkDead(record, storagePageFill(STORAGE_PAGE_OF_SLOT(record)) - record % STORAGE_SLOTS_PER_PAGE);
+        return EEPROM_ERROR;
+    }
+    storageMarkDead(oldRecord, 1 + written);
+    writer->slot = record;
+    openWritePage = STORAGE_PAGE_OF_SLOT(writer->slot);
+    writer->firstExtent = first;
+    writer->extentEnd = EXTENT_ADDRESS(first + written - 1) + EXTENT_SIZE;
+    writer->nextAddress = writer->extentEnd;
+    return EEPROM_OK;
+}
+
+//hands the next free extent to the writer and links it behind the current one
+static int allocateExtent(DiaryWriter* writer)
+{
+    uint16_t extent = storageTakeSlot();
+    if(extent == STORAGE_NO_SLOT)
+    {
+        if(moveOpenEntry(writer) != EEPROM_OK)
+        {
+            formatPuts("\r\nERROR: Entry is too long!");
+            return EEPROM_ERROR;
+        }
+        extent = storageTakeSlot();
+        if(extent == STORAGE_NO_SLOT)
+        {
+            return EEPROM_ERROR;
+        }
+    }
+
+    //the link halfword of the current extent is still erased, so it can be programmed now
+    if(writer->extentEnd != 0)
     {
-        DiaryEntryIndex meta;
-        uint32_t metaAddress = FLASH_PAGE_62_ADDRESS + i * sizeof(DiaryEntryIndex);
-        eepromRead(metaAddress - FLASH_PAGE_62_ADDRESS, (uint8_t*)&meta, sizeof(meta));
-        
-        if(meta.flashAddress != 0xFFFFFFFF && meta.flashAddress + meta.length > highestUsed) 
+        int result = flashProgram(writer->extentEnd - EXTENT_SIZE, (const uint8_t*)&extent, sizeof(extent), 0);
+        if(result != EEPROM_OK)
         {
-            highestUsed = meta.flashAddress + meta.length;
+            //the new extent is not part of the chain, so abortDiaryWrite would not count it
+            storageMarkDead(extent, 1);
+            return result;
         }
     }
-    
-    //align to the next halfword bound
-    return (highestUsed + 1) & ~1;
+    else
+    {
+        writer->firstExtent = extent;
+    }
+    writer->nextAddress = EXTENT_ADDRESS(extent) + EXTENT_HEADER_SIZE;
+    writer->extentEnd = EXTENT_ADDRESS(extent) + EXTENT_SIZE;
+    return EEPROM_OK;
 }
 
-int storeDiaryEntry(const char* tag, const uint8_t* content, uint16_t len, uint8_t encrypt)
+//opens a new entry, checking up front that expectedLength bytes fit in the page it starts in
+//appends can run past expectedLength up to MAX_ENTRY_LENGTH
+//flags is ENTRY_FLAGS_LIVE with any ENTRY_FLAG_ bits that apply to the content cleared
+int beginDiaryWrite(DiaryWriter* writer, const char* tag, uint16_t flags, uint16_t expectedLength)
 {
-    //find the next available space
-    uint32_t contentAddress;
-    contentAddress = findNextFreeAddress();
-    
-    //verify the space
-    if(contentAddress + len > FLASH_PAGE_63_ADDRESS + FLASH_PAGE_SIZE) 
+    uint32_t startCycles = cycleCounterNow();
+    ensureIndexCache();
+    openWritePage = STORAGE_NO_PAGE;
+
+    if(expectedLength > MAX_ENTRY_LENGTH)
+    {
+        formatPuts("\r\nERROR: Entry is too long!");
+        return -1;
+    }
+
+    //tombstones only leave the index when their page is recycled
+    while(cachedCount >= MAX_ENTRIES && cachedDeleted > 0)
+    {
+        uint16_t victim = storagePickVictim(STORAGE_NO_PAGE);
+        if(victim == STORAGE_NO_PAGE || recyclePage(victim) != EEPROM_OK)
+        {
+            break;
+        }
+    }
+    if(cachedCount >= MAX_ENTRIES)
+    {
+        formatPuts("\r\nERROR: Index table full!");
+        return -1;
+    }
+
+    //the record and the expected extents have to fit in the page being filled
+    if(storageSlotsLeft() < 1 + extentsFor(expectedLength) && openFreshPage(1 + extentsFor(expectedLength)) != EEPROM_OK)
     {
-        //error if not enough space
-        printf("\r\nERROR: Insufficient flash space!");
         return -1;
     }
 
-    //prepare the metadata
+    //timestamps never go back in write order, even if the clock was set back, so the index stays sorted by time
+    uint32_t timestamp = rtcGetTimestamp();
+    if(cachedCount > 0 && recordAt(entrySlots[cachedCount - 1])->timestamp > timestamp)
+    {
+        timestamp = recordAt(entrySlots[cachedCount - 1])->timestamp;
+    }
+
+    //prepare the metadata, the length is filled in as content arrives
     DiaryEntryIndex meta = 
     {
-        .flashAddress = contentAddress,
-        .length = len,
-        .timestamp = rtcGetTimestamp()
+        .marker = RECORD_MARKER,
+        .length = 0,
+        .flags = flags,
+        .timestamp = timestamp
     };
     strncpy(meta.tag, tag, MAX_TAG_LENGTH - 1);
     meta.tag[MAX_TAG_LENGTH-1] = '\0';
-    printf("\r\nWriting content to 0x%08lX...", contentAddress);
-    
-    //write the content
-    flashUnlock();
-    
-    //check if have to erase the content page
-    uint32_t contentPage = (contentAddress >= FLASH_PAGE_63_ADDRESS) ? FLASH_PAGE_63_ADDRESS : FLASH_PAGE_62_ADDRESS;
 
-    //erase the page if address and page match       
-    if(contentAddress == contentPage) 
+    //the sequence comes from the slot the record is first given, it stays with the entry if it moves
+    writer->meta = meta;
+    writer->slot = storageTakeSlot();
+    writer->meta.sequence = storageSlotSequence(writer->slot);
+    openWritePage = STORAGE_PAGE_OF_SLOT(writer->slot);
+    writer->blockFill = 0;
+    writer->extentEnd = 0;
+    if(allocateExtent(writer) != EEPROM_OK)
     {
-        flashErasePage(contentPage);
+        return -1;
     }
+    FormatBuffer* line = formatBegin();
+    formatText(line, "\r\nWriting content to 0x");
+    formatHex(line, STORAGE_SLOT_ADDRESS(writer->slot), 8);
+    formatText(line, "...");
+    formatSend(line);
 
-    uint32_t startTime = rtcGetTimestamp();
-    uint32_t timeoutMs = 1000;
-    
-    for(uint16_t i = 0; i < len; i += 2) 
+    writeStats.cycles += cycleCounterNow() - startCycles;
+    return 0;
+}
+
+//encrypts the filled part of the current keystream block and programs it, following the chain as extents fill
+static int flushWriteBlock(DiaryWriter* writer)
+{
+    uint16_t remaining = writer->blockFill;
+    const uint8_t* bytes = (const uint8_t*)writer->block;
+
+    cryptoEncrypt((uint8_t*)writer->block, remaining, writer->meta.sequence, writer->meta.length - remaining);
+    writer->blockFill = 0;
+
+    while(remaining > 0)
     {
-        uint16_t val = (i + 1 < len) ? (content[i + 1] << 8) | content[i] : content[i];
-        
-        flashWriteHalfword(contentAddress + i, val);
-        
-        while(!(FLASH->SR & FLASH_SR_EOP_Msk)) 
+        if(writer->nextAddress == writer->extentEnd && allocateExtent(writer) != EEPROM_OK)
         {
-            if((rtcGetTimestamp() - startTime) > timeoutMs) 
-            {
-                printf("\r\nERROR: Flash write timeout!");
-                flashLock();
-                return -1;
-            }
+            return EEPROM_ERROR;
+        }
+        uint16_t length = writer->extentEnd - writer->nextAddress;
+        if(length > remaining)
+        {
+            length = remaining;
+        }
+
+        //space past the free pointer is always erased, so skip the erased check
+        int result = flashProgram(writer->nextAddress, bytes, length, 0);
+        if(result != EEPROM_OK)
+        {
+            return result;
         }
-        FLASH->SR = FLASH_SR_EOP_Msk;
+        writer->nextAddress += length;
+        bytes += length;
+        remaining -= length;
     }
+    return EEPROM_OK;
+}
 
-    //write the prepared metadata
-    uint32_t metaAddress = FLASH_PAGE_62_ADDRESS + getEntryCount() * sizeof(DiaryEntryIndex);
-    
-    //check if need to erase index page
-    if(metaAddress >= FLASH_PAGE_63_ADDRESS) 
+//streams plaintext into the entry, each keystream block is encrypted and programmed once it fills
+int appendDiaryWrite(DiaryWriter* writer, const uint8_t* data, uint16_t length)
+{
+    uint32_t startCycles = cycleCounterNow();
+    int result = 0;
+
+    if(writer->meta.length + length > MAX_ENTRY_LENGTH)
     {
-        flashErasePage(FLASH_PAGE_63_ADDRESS);
+        formatPuts("\r\nERROR: Entry is too long!");
+        return -1;
     }
 
-    uint8_t *metaPointer = (uint8_t*)&meta;
-    for(uint16_t i = 0; i < sizeof(meta); i += 2) 
+    while(length > 0)
     {
-        uint16_t val = (i+1 < sizeof(meta)) ? (metaPointer[i+1] << 8) | metaPointer[i] : metaPointer[i];
-        
-        flashWriteHalfword(metaAddress + i, val);
-        startTime = rtcGetTimestamp();
-        while(!(FLASH->SR & FLASH_SR_EOP_Msk)) 
+        uint16_t take = CRYPTO_BLOCK_BYTES - writer->blockFill;
+        if(take > length)
         {
-            if((rtcGetTimestamp() - startTime) > timeoutMs) 
-            {
-                printf("\r\nERROR: Metadata write timeout!");
-                flashLock();
-                return -1;
-            }
+            take = length;
+        }
+        memcpy((uint8_t*)writer->block + writer->blockFill, data, take);
+        writer->blockFill += take;
+        writer->meta.length += take;
+        data += take;
+        length -= take;
+
+        if(writer->blockFill == CRYPTO_BLOCK_BYTES && flushWriteBlock(writer) != EEPROM_OK)
+        {
+            formatPuts("\r\nERROR: Flash write failed");
+            result = -1;
+            break;
         }
-        FLASH->SR = FLASH_SR_EOP_Msk;
     }
-    
-    //lock the flash before returning
-    flashLock();
+
+    writeStats.cycles += cycleCounterNow() - startCycles;
+    return result;
+}
+
+//programs the tail of the content and then the record, which makes the entry visible
+int finishDiaryWrite(DiaryWriter* writer)
+{
+    uint32_t startCycles = cycleCounterNow();
+
+    int result = flushWriteBlock(writer);
+    if(result != EEPROM_OK)
+    {
+        FormatBuffer* line = formatBegin();
+        formatText(line, "\r\nERROR: Flash write failed (");
+        formatSigned(line, result, 0);
+        formatText(line, ")");
+        formatSend(line);
+        return -1;
+    }
+
+    //write the prepared metadata, the content is complete so the entry can be committed
+    writer->meta.crc = recordCrc(&writer->meta);
+    result = programRecord(writer->slot, &writer->meta);
+    if(result != EEPROM_OK)
+    {
+        FormatBuffer* line = formatBegin();
+        formatText(line, "\r\nERROR: Metadata write failed (");
+        formatSigned(line, result, 0);
+        formatText(line, ")");
+        formatSend(line);
+        return -1;
+    }
+
+    openWritePage = STORAGE_NO_PAGE;
+
+    //keep the index coherent with what was just programmed
+    entrySlots[cachedCount] = writer->slot;
+    indexTag(cachedCount, tagHashOf(writer->meta.tag));
+    cachedCount++;
+
+    writeStats.entries++;
+    writeStats.bytes += writer->meta.length;
+    storageCountLogical(writer->meta.length);
+    writeStats.slots += 1 + extentsFor(writer->meta.length);
+    writeStats.cycles += cycleCounterNow() - startCycles;
     return 0;
 }
 
-int retrieveDiaryEntry(uint16_t index, char* outputBuffer, uint8_t decrypt) 
+//gives up on an entry after beginDiaryWrite, appendDiaryWrite or finishDiaryWrite failed
+//the slots it took are counted dead so compaction can reclaim them, and background compaction may run again
+void abortDiaryWrite(DiaryWriter* writer)
 {
-    DiaryEntryIndex meta;
-    uint32_t metaAddress = FLASH_PAGE_62_ADDRESS + index * sizeof(DiaryEntryIndex);
-    
-    //read the metadata for retrieval
-    if(eepromRead(metaAddress - FLASH_PAGE_62_ADDRESS, (uint8_t*)&meta, sizeof(meta)) != EEPROM_OK) 
+    //nothing was taken, or the entry was already committed or aborted
+    if(openWritePage == STORAGE_NO_PAGE)
+    {
+        return;
+    }
+    //the record slot and the extents after it are contiguous in one page
+    uint16_t taken = 1;
+    if(writer->extentEnd != 0)
+    {
+        taken += EXTENT_OF(writer->extentEnd - 1) - writer->firstExtent + 1;
+    }
+    storageMarkDead(writer->slot, taken);
+    openWritePage = STORAGE_NO_PAGE;
+}
+
+void getDiaryWriteStats(DiaryWriteStats* stats)
+{
+    *stats = writeStats;
+}
+
+//stores a complete plaintext entry in one pass, encrypting it on its way into flash
+int storeDiaryEntry(const char* tag, const uint8_t* content, uint16_t len, uint16_t flags)
+{
+    OP_STATS_BEGIN(store);
+    DiaryWriter writer;
+    int result = -1;
+    if(beginDiaryWrite(&writer, tag, flags, len) == 0 && appendDiaryWrite(&writer, content, len) == 0)
+    {
+        result = finishDiaryWrite(&writer);
+    }
+    if(result != 0)
+    {
+        abortDiaryWrite(&writer);
+    }
+    OP_STATS_END(store, OP_STORE);
+    return result;
+}
+
+//marks an entry deleted by programming its flags halfword to zero, no erase needed
+//returns 0 on success, 1 if it was already deleted, -1 for an invalid index
+int deleteDiaryEntry(uint16_t index)
+{
+    const DiaryEntryIndex* meta = getCachedEntry(index);
+    if(!meta)
+    {
+        return -1;
+    }
+    if(ENTRY_IS_DELETED(meta))
+    {
+        return 1;
+    }
+
+    //clearing bits is always allowed on flash, so the tombstone goes straight over the record
+    uint16_t tombstone = ENTRY_FLAGS_DELETED;
+    uint32_t flagsAddress = STORAGE_SLOT_ADDRESS(entrySlots[index]) + offsetof(DiaryEntryIndex, flags);
+    if(flashProgram(flagsAddress, (const uint8_t*)&tombstone, sizeof(tombstone), 0) != EEPROM_OK)
     {
-        printf("\r\nError: Invalid entry index");
+        return -1;
+    }
+
+    //the record and its extents can go the next time their page is recycled
+    storageMarkDead(entrySlots[index], 1 + extentsFor(meta->length));
+    cachedDeleted++;
+    compactionStalled = 0;
+    return 0;
+}
+
+//opens an entry for streaming out with readDiaryChunk, returns -1 if it does not exist or was deleted
+int beginDiaryRead(DiaryReader* reader, uint16_t index, uint8_t decrypt)
+{
+    //look up the metadata for retrieval
+    const DiaryEntryIndex* meta = getCachedEntry(index);
+    if(!meta) 
+    {
+        formatPuts("\r\nError: Invalid entry index");
         return -1;
     }
     
     //verify if the entry exists
-    if(meta.flashAddress == 0xFFFFFFFF) 
+    if(ENTRY_IS_DELETED(meta)) 
     {
-        printf("\r\nError: Entry has been deleted");
+        formatPuts("\r\nError: Entry has been deleted");
         return -1;
     }
-    
-    //read the content if entry exists
-    if(eepromRead(meta.flashAddress - FLASH_PAGE_62_ADDRESS, (uint8_t*)outputBuffer, meta.length) != EEPROM_OK) 
+
+    openReader(reader, entrySlots[index], meta, decrypt);
+    return 0;
+}
+
+//copies the next stored bytes of the entry into buffer, returns how many, 0 at the end, -1 on a broken chain
+int readDiaryChunk(DiaryReader* reader, uint8_t* buffer, uint16_t capacity)
+{
+    uint16_t start = reader->offset;
+    uint16_t total = 0;
+
+    while(total < capacity && reader->offset < reader->length)
+    {
+        if(reader->address == reader->extentEnd)
+        {
+            uint16_t next = flashReadHalfword(reader->extentEnd - EXTENT_SIZE);
+            if(next >= EXTENT_COUNT)
+            {
+                return -1;
+            }
+            reader->address = EXTENT_ADDRESS(next) + EXTENT_HEADER_SIZE;
+            reader->extentEnd = EXTENT_ADDRESS(next) + EXTENT_SIZE;
+        }
+
+        uint16_t length = reader->extentEnd - reader->address;
+        if(length > capacity - total)
+        {
+            length = capacity - total;
+        }
+        if(length > reader->length - reader->offset)
+        {
+            length = reader->length - reader->offset;
+        }
+        if(eepromRead(reader->address - STORAGE_BASE_ADDRESS, buffer + total, length) != EEPROM_OK)
+        {
+            return -1;
+        }
+        reader->address += length;
+        reader->offset += length;
+        total += length;
+    }
+
+    //one pass over the whole chunk keeps the keystream blocks aligned
+    if(reader->decrypt)
+    {
+        cryptoDecrypt(buffer, total, reader->nonce, start);
+    }
+    return total;
+}
+
+//reads an entry's text into outputBuffer, expanding it if it was stored compressed
+//text past capacity - 1 bytes is cut off, beginDiaryRead and readDiaryChunk stream an entry of any length in full
+static int readEntryContent(uint16_t index, char* outputBuffer, uint16_t capacity, uint8_t decrypt) 
+{
+    DiaryReader reader;
+    if(capacity == 0 || beginDiaryRead(&reader, index, decrypt) != 0)
     {
         return -1;
     }
+    const DiaryEntryIndex* meta = getCachedEntry(index);
+    uint16_t room = capacity - 1;
+    int length = 0;
     
-    //make sure null termination
-    outputBuffer[meta.length] = '\0';
-    
-    //decryption
-    if(decrypt) {
-        xorDecrypt((uint8_t*)outputBuffer, meta.length, ENCRYPTION_KEY);
+    //plain text goes straight into the caller's buffer, whatever does not fit is left unread
+    if(!ENTRY_IS_COMPRESSED(meta))
+    {
+        length = readDiaryChunk(&reader, (uint8_t*)outputBuffer, room);
+        if(length < 0)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        //compressed text is expanded a chunk at a time, so neither length is limited by a scratch buffer
+        uint8_t stored[CONTENT_SEARCH_CHUNK];
+        uint8_t text[CONTENT_SEARCH_CHUNK * COMPRESS_MAX_FRAGMENT];
+        uint8_t escaped = 0;
+        int chunk = 0;
+        while(length < room && (chunk = readDiaryChunk(&reader, stored, sizeof(stored))) > 0)
+        {
+            chunk = expandTextChunk(&escaped, stored, chunk, text, sizeof(text));
+            if(chunk < 0)
+            {
+                break;
+            }
+            if(chunk > room - length)
+            {
+                chunk = room - length;
+            }
+            memcpy(outputBuffer + length, text, chunk);
+            length += chunk;
+        }
+        if(chunk < 0)
+        {
+            formatPuts("\r\nError: Entry content is corrupt");
+            return -1;
+        }
     }
     
-    //return the length of metadata
-    return meta.length;
+    //make sure null termination
+    outputBuffer[length] = '\0';
+    
+    //return the length of the content
+    return length;
+}
+
+//returns the length placed in outputBuffer, at most capacity - 1 bytes plus a terminator, or -1
+int retrieveDiaryEntry(uint16_t index, char* outputBuffer, uint16_t capacity, uint8_t decrypt) 
+{
+    OP_STATS_BEGIN(retrieve);
+    int length = readEntryContent(index, outputBuffer, capacity, decrypt);
+    OP_STATS_END(retrieve, OP_RETRIEVE);
+    return length;
 }
 
 int getEntryCount(void) 
 {
-    uint32_t addr = INDEX_TABLE_ADDRESS;
-    DiaryEntryIndex meta;
-    int count = 0;
-    
-    while (addr < CONTENT_START_ADDRESS) 
+    ensureIndexCache();
+    return cachedCount;
+}
+
+//number of entries that have not been deleted
+int getLiveEntryCount(void)
+{
+    ensureIndexCache();
+    return cachedCount - cachedDeleted;
+}
+
+//index of the first entry written at or after timestamp, getEntryCount() if there is none
+//the index is in write order and so in time order; tombstoned records keep their timestamp and serve as probes too
+int findFirstEntrySince(uint32_t timestamp)
+{
+    ensureIndexCache();
+    int low = 0;
+    int high = cachedCount;
+    while(low < high)
     {
-        if(eepromRead(addr - FLASH_PAGE_62_ADDRESS, (uint8_t*)&meta, sizeof(meta)) != EEPROM_OK) 
+        int middle = (low + high) / 2;
+        if(recordAt(entrySlots[middle])->timestamp < timestamp)
         {
-            break;
+            low = middle + 1;
         }
-        if(meta.flashAddress == 0xFFFFFFFF) 
+        else
         {
-            break;
+            high = middle;
         }
-        count++;
-        addr += sizeof(DiaryEntryIndex);
     }
-    
-    return count;
+    return low;
 }
 
-int findEntryByTag(const char* tag, DiaryEntryIndex* result) 
+//index of the oldest of the newest count live entries, 0 if there are no more than count
+int findLastLiveEntries(uint16_t count)
+{
+    ensureIndexCache();
+    int index = cachedCount;
+    while(index > 0 && count > 0)
+    {
+        index--;
+        if(!ENTRY_IS_DELETED(recordAt(entrySlots[index])))
+        {
+            count--;
+        }
+    }
+    return index;
+}
+
+//index of the first entry whose sequence is at least sequence, the index is sorted by sequence
+static int findFirstEntryFromSequence(uint32_t sequence)
+{
+    int low = 0;
+    int high = cachedCount;
+    while(low < high)
+    {
+        int middle = (low + high) / 2;
+        if(sequenceAt(entrySlots[middle]) < sequence)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+//index position of the entry with this sequence, -1 if there is none
+//positions move when compaction drops tombstones from the index, a sequence never does
+int findEntryBySequence(uint32_t sequence)
+{
+    ensureIndexCache();
+    int index = findFirstEntryFromSequence(sequence);
+    return (index < cachedCount && sequenceAt(entrySlots[index]) == sequence) ? index : -1;
+}
+
+//starts a cursor over the entries from index first up to but not including end
+//entries written later are past the end of the range even when end is the end of the index
+void openEntryCursor(EntryCursor* cursor, int first, int end)
+{
+    ensureIndexCache();
+    if(end > cachedCount)
+    {
+        end = cachedCount;
+    }
+    if(end < cachedCount)
+    {
+        cursor->endSequence = sequenceAt(entrySlots[end]);
+    }
+    else
+    {
+        cursor->endSequence = (end > 0) ? sequenceAt(entrySlots[end - 1]) + 1 : 0;
+    }
+    cursor->nextSequence = (first < end) ? sequenceAt(entrySlots[first]) : cursor->endSequence;
+}
+
+//hands out the next window of at most window index positions, live or not, and moves the cursor past it
+//sets first to the window's first index and returns the index after its last, -1 once the range is done
+//a window costs one binary search plus a record read per position, whatever the size of the index
+int nextCursorWindow(EntryCursor* cursor, uint16_t window, int* first)
+{
+    ensureIndexCache();
+    if(entryCursorDone(cursor))
+    {
+        return -1;
+    }
+    int start = findFirstEntryFromSequence(cursor->nextSequence);
+    int end = start;
+    while(end < cachedCount && end - start < window && sequenceAt(entrySlots[end]) < cursor->endSequence)
+    {
+        end++;
+    }
+
+    cursor->nextSequence = (end < cachedCount) ? sequenceAt(entrySlots[end]) : cursor->endSequence;
+    if(cursor->nextSequence > cursor->endSequence)
+    {
+        cursor->nextSequence = cursor->endSequence;
+    }
+    if(end == start)
+    {
+        return -1;
+    }
+    *first = start;
+    return end;
+}
+
+int entryCursorDone(const EntryCursor* cursor)
+{
+    return cursor->nextSequence >= cursor->endSequence;
+}
+
+//starts an iterator over every live entry whose tag matches
+void beginTagSearch(TagSearch* search, const char* tag)
 {
-    int count = getEntryCount();
-    //debug search print for testing
+    ensureIndexCache();
+    strncpy(search->tag, tag, MAX_TAG_LENGTH-1);
+    search->tag[MAX_TAG_LENGTH-1] = '\0';
+
+    search->tagHash = tagHashOf(search->tag);
+    search->next = 0;
+    cacheStats.tagSearches++;
+
+    //the bloom filter answers most misses without looking at any record
+    if(!bloomMayContain(search->tagHash))
+    {
+        cacheStats.bloomRejects++;
+        search->next = -1;
+    }
+
     #if DEBUG_SEARCH
-    printf("\r\nSEARCH DEBUG: Looking for '%s' (%d entries)", tag, count);
+    FormatBuffer* line = formatBegin();
+    formatText(line, "\r\nSEARCH DEBUG: Looking for '");
+    formatText(line, search->tag);
+    formatText(line, "' (");
+    formatUnsigned(line, cachedCount, 0, ' ');
+    formatText(line, " entries)");
+    formatSend(line);
     #endif
+}
 
-    char cleanTag[MAX_TAG_LENGTH];
-    strncpy(cleanTag, tag, MAX_TAG_LENGTH-1);
-    cleanTag[MAX_TAG_LENGTH-1] = '\0';
+//copies the next matching record into result and returns its index, or -1 when there are no more
+int nextTagMatch(TagSearch* search, DiaryEntryIndex* result)
+{
+    if(search->next < 0)
+    {
+        return -1;
+    }
 
-    for (int i = 0; i < count; i++) 
+    for(int i = search->next; i < cachedCount; i++)
     {
-        uint32_t metaAddress = INDEX_TABLE_ADDRESS + i * sizeof(DiaryEntryIndex);
-        if (eepromRead(metaAddress - FLASH_PAGE_62_ADDRESS, (uint8_t*)result, sizeof(DiaryEntryIndex)) != EEPROM_OK) 
+        //only entries with the same 16 bit hash need their full tag compared
+        if(tagHashes[i] != search->tagHash)
         {
-            return -1;
+            continue;
+        }
+        const DiaryEntryIndex* meta = recordAt(entrySlots[i]);
+        if(ENTRY_IS_DELETED(meta))
+        {
+            continue;
+        }
+        cacheStats.tagCandidates++;
+
+        if(strncmp(meta->tag, search->tag, MAX_TAG_LENGTH) == 0)
+        {
+            *result = *meta;
+            search->next = i + 1;
+            return i;
         }
+    }
+    search->next = -1;
+    return -1;
+}
 
+//starts an iterator over every live entry whose text contains pattern, -1 if the pattern is empty or too long
+int beginContentSearch(ContentSearch* search, const char* pattern)
+{
+    ensureIndexCache();
+    search->next = 0;
+    search->bytesScanned = 0;
+    search->entriesScanned = 0;
+    return textSearchInit(&search->matcher, pattern);
+}
 
-        #if DEBUG_SEARCH
-        printf("\r\n Entry %d: tag = '%s' address = 0x%08lX", i, result->tag, result->flashAddress);
+//streams one entry through the matcher a chunk at a time, decrypting and expanding each chunk on its own
+//returns the text offset of the first match, -1 if there is none, -2 if the entry cannot be read
+static int32_t scanEntryContent(ContentSearch* search, int index)
+{
+    const DiaryEntryIndex* meta = recordAt(entrySlots[index]);
+    uint8_t compressed = ENTRY_IS_COMPRESSED(meta);
+    uint8_t stored[CONTENT_SEARCH_CHUNK];
+    uint8_t text[CONTENT_SEARCH_CHUNK * COMPRESS_MAX_FRAGMENT];
+    uint8_t escaped = 0;
+    DiaryReader reader;
+    int length;
 
-        printf("\r\n Raw tag bytes: ");
-        for(int j = 0; j < MAX_TAG_LENGTH; j++) 
+    openReader(&reader, entrySlots[index], meta, 1);
+    textSearchRestart(&search->matcher);
+    search->entriesScanned++;
+    while((length = readDiaryChunk(&reader, stored, sizeof(stored))) > 0)
+    {
+        search->bytesScanned += length;
+        const uint8_t* plain = stored;
+        if(compressed)
         {
-            printf("%02X ", result->tag[j] & 0xFF);
+            length = expandTextChunk(&escaped, stored, length, text, sizeof(text));
+            plain = text;
         }
-        #endif
+        if(length < 0)
+        {
+            return -2;
+        }
+        int32_t offset = textSearchFeed(&search->matcher, plain, length);
+        if(offset >= 0)
+        {
+            return offset;
+        }
+    }
+    return (length < 0) ? -2 : -1;
+}
+
+//returns the index of the next entry whose text contains the pattern and sets offset to the first match in it
+//returns -1 when there are no more, unreadable entries are skipped
+int nextContentMatch(ContentSearch* search, uint32_t* offset)
+{
+    if(search->next < 0)
+    {
+        return -1;
+    }
 
-       if(strncmp(result->tag, cleanTag, MAX_TAG_LENGTH) == 0) 
-       {
-            #if DEBUG_SEARCH
-            printf("\r\n  MATCH FOUND!");
-            #endif
-            return 0;
+    for(int i = search->next; i < cachedCount; i++)
+    {
+        if(ENTRY_IS_DELETED(recordAt(entrySlots[i])))
+        {
+            continue;
+        }
+        int32_t found = scanEntryContent(search, i);
+        if(found >= 0)
+        {
+            *offset = found;
+            search->next = i + 1;
+            return i;
         }
     }
+    search->next = -1;
     return -1;
-}
\ No newline at end of file
+}
+
+//returns 0 and the first entry with a matching tag, or -1 if there is none
+int findEntryByTag(const char* tag, DiaryEntryIndex* result) 
+{
+    OP_STATS_BEGIN(find);
+    TagSearch search;
+    beginTagSearch(&search, tag);
+    int found = nextTagMatch(&search, result);
+    OP_STATS_END(find, OP_FIND);
+    return (found >= 0) ? 0 : -1;
+}
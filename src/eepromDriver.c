@@ -1,10 +1,38 @@
 /*
 This module is the low-level driver for the EEPROM emulation on the STM32 flash memory
+On host builds (HOST_BUILD) the flash primitives come from flashSim.c instead
 */
 
 #include "eepromDriver.h"
+#include "format.h"
+#include "cycleCounter.h"
+#include "ramFunc.h"
 #include "stm32f0xx.h"
 
+#ifndef HOST_BUILD
+
+#include <string.h>
+
+//page erases since reset
+static uint32_t eraseCount = 0;
+//bytes handed out by flashMapSpan since reset
+static uint32_t bytesRead = 0;
+
+//16 core exceptions plus the 32 interrupts of the F091
+#define VECTOR_COUNT 48
+
+//copy of the vector table at the start of SRAM, see STM32F091RCTx_FLASH.ld
+static uint32_t ramVectors[VECTOR_COUNT] __attribute__((section(".RamVectors")));
+
+//maps SRAM at address 0 so exceptions read their vectors from the copy instead of flash
+//the Cortex-M0 has no VTOR, remapping is the only way to move the table on the F0
+void flashInit(void)
+{
+    memcpy(ramVectors, (const void*)FLASH_BASE_ADDRESS, sizeof(ramVectors));
+    RCC->APB2ENR |= RCC_APB2ENR_SYSCFGCOMPEN;
+    SYSCFG->CFGR1 = (SYSCFG->CFGR1 & ~SYSCFG_CFGR1_MEM_MODE) | SYSCFG_CFGR1_MEM_MODE_0 | SYSCFG_CFGR1_MEM_MODE_1;
+}
+
 //unlocks the flash memory for the write/erase operations
 void flashUnlock(void)
 {
@@ -27,8 +55,8 @@ void flashLock(void)
     FLASH->CR |= FLASH_CR_LOCK;
 }
 
-//erases a flash page
-void flashErasePage(uint32_t pageAddress)
+//erases a flash page, from SRAM so interrupts can run during the erase
+RAMFUNC void flashErasePage(uint32_t pageAddress)
 {
     /*
     steps pulled from STM32F0x1 family reference manual, in order to perform flash memory page erase, the following procedure must be followed:
@@ -53,43 +81,97 @@ void flashErasePage(uint32_t pageAddress)
     
     //start erase with 10ms timeout
     FLASH->CR |= FLASH_CR_STRT;
+    eraseCount++;
     uint32_t timeout = 1000000;
     while ((FLASH->SR & FLASH_SR_BSY) && --timeout);
     
     if (!timeout) 
     {
-        printf("\r\nERASE TIMEOUT! SR:0x%08lX", FLASH->SR);
+        FormatBuffer* line = formatBegin();
+        formatText(line, "\r\nERASE TIMEOUT! SR:0x");
+        formatHex(line, FLASH->SR, 8);
+        formatSend(line);
         FLASH->CR &= ~FLASH_CR_PER;
         return;
     }
     
     //verify erase
     if (*(__IO uint32_t*)pageAddress != 0xFFFFFFFF) {
-        printf("\r\nERASE VERIFY FAILED @ 0x%08lX", pageAddress);
+        FormatBuffer* line = formatBegin();
+        formatText(line, "\r\nERASE VERIFY FAILED @ 0x");
+        formatHex(line, pageAddress, 8);
+        formatSend(line);
     }
     
     FLASH->CR &= ~FLASH_CR_PER;
 }
 
-void flashWriteHalfword(uint32_t address, uint16_t data) 
+//programs a run of halfwords with the flash already unlocked by flashProgram, from SRAM like the erase
+RAMFUNC int flashProgramBurst(uint32_t address, const uint8_t* data, uint16_t length, uint8_t options, uint32_t* programmed)
 {
-    //wait for previous operations
+    int result = EEPROM_OK;
+
+    //wait for previous operations and clear stale flags once for the whole batch
     while(FLASH->SR & FLASH_SR_BSY);
-    
-    //check if write is needed
-    if(*(__IO uint16_t*)address == data)
-    {
-        return;
-    }
-    
-    //check if location is erased
-    if(*(__IO uint16_t*)address != 0xFFFF) 
+    FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPERR;
+    FLASH->CR |= FLASH_CR_PG;
+
+    for(uint16_t i = 0; i < length; i += 2)
     {
-        printf("\r\n WARNING: Write to non-erased location 0x%08lX", address);
+        uint16_t val = (i + 1 < length) ? (data[i + 1] << 8) | data[i] : data[i];
+        __IO uint16_t* target = (__IO uint16_t*)(address + i);
+
+        //an erased halfword already reads 0xFFFF, programming it would change nothing
+        if(val == 0xFFFF)
+        {
+            continue;
+        }
+
+        //optional check for callers that cannot be sure the target is still erased
+        if(options & FLASH_PROGRAM_VERIFY_ERASED)
+        {
+            uint16_t current = *target;
+            if(current == val)
+            {
+                continue;
+            }
+            if(current != 0xFFFF && val != 0x0000)
+            {
+                result = EEPROM_WRITE_FAILED;
+                break;
+            }
+        }
+
+        *target = val;
+
+        //one BSY wait and one status check per halfword
+        uint32_t timeout = FLASH_PROGRAM_TIMEOUT;
+        while((FLASH->SR & FLASH_SR_BSY) && --timeout);
+        uint32_t status = FLASH->SR;
+
+        if(!timeout)
+        {
+            result = EEPROM_TIMEOUT;
+            break;
+        }
+        if(status & FLASH_SR_WRPERR)
+        {
+            result = EEPROM_WRITE_PROTECTED;
+            break;
+        }
+        if(status & FLASH_SR_PGERR)
+        {
+            result = EEPROM_WRITE_FAILED;
+            break;
+        }
+        FLASH->SR = FLASH_SR_EOP;
+        (*programmed)++;
     }
-    
-    FLASH->CR |= FLASH_CR_PG;
-    *(__IO uint16_t*)address = data;
+
+    //clear any error flags left by a failed write and leave programming mode
+    FLASH->SR = FLASH_SR_PGERR | FLASH_SR_WRPERR;
+    FLASH->CR &= ~FLASH_CR_PG;
+    return result;
 }
 
 //reads a 16 bit halfword from the flash memory
@@ -98,54 +180,149 @@ uint16_t flashReadHalfword(uint32_t address)
     return *(__IO uint16_t*)address;
 }
 
+//flash is memory-mapped, so a span is read straight from its address
+const uint8_t* flashMapSpan(uint32_t address, uint16_t length)
+{
+    bytesRead += length;
+    return (const uint8_t*)address;
+}
+
+uint32_t flashGetEraseCount(void)
+{
+    return eraseCount;
+}
+
+uint32_t flashGetBytesRead(void)
+{
+    return bytesRead;
+}
+
+#endif
+
+//halfword programming counters across every flashProgram batch
+static FlashProgramStats programStats;
+
+//the single programming engine, unlocks once per batch and restores the lock state afterwards
+int flashProgram(uint32_t address, const uint8_t* data, uint16_t length, uint8_t options)
+{
+    uint32_t programmed = 0;
+    uint32_t startCycles = cycleCounterNow();
+    int wasLocked = (FLASH->CR & FLASH_CR_LOCK) != 0;
+
+    flashUnlock();
+    int result = flashProgramBurst(address, data, length, options, &programmed);
+    if(wasLocked)
+    {
+        flashLock();
+    }
+
+    programStats.batches++;
+    programStats.halfwords += programmed;
+    programStats.cycles += cycleCounterNow() - startCycles;
+    if(result != EEPROM_OK)
+    {
+        programStats.errors++;
+    }
+    return result;
+}
+
+//programs a single halfword, the caller must know the location is erased (or write 0x0000)
+void flashWriteHalfword(uint32_t address, uint16_t data) 
+{
+    uint8_t bytes[2] = { data & 0xFF, data >> 8 };
+    flashProgram(address, bytes, sizeof(bytes), 0);
+}
+
+void flashGetProgramStats(FlashProgramStats* stats)
+{
+    *stats = programStats;
+    stats->halfwordsPerMs = programStats.cycles ? (uint32_t)((uint64_t)programStats.halfwords * CYCLES_PER_MS / programStats.cycles) : 0;
+}
+
 //writes data to the EEPROM
 int eepromWrite(uint32_t virtualAddress, const uint8_t* data, uint16_t length)
 {
     //calcualte flash address
-    uint32_t flashAddress = FLASH_PAGE_62_ADDRESS + virtualAddress;
+    uint32_t flashAddress = STORAGE_BASE_ADDRESS + virtualAddress;
     
     //check validity of address
-    if (flashAddress + length > FLASH_PAGE_63_ADDRESS + FLASH_PAGE_SIZE) 
+    if (flashAddress + length > STORAGE_END_ADDRESS) 
     {
         return EEPROM_INVALID_ADDRESS;
     }
 
-    //unlock the flash before writing to it
-    flashUnlock();
+    //the caller may be overwriting old data, so check each location first
+    return flashProgram(flashAddress, data, length, FLASH_PROGRAM_VERIFY_ERASED);
+}
 
-    //write to the flash one halfword at a time
-    for (uint16_t i = 0; i < length; i += 2) 
+//copies out of memory-mapped flash using word loads wherever the alignment allows
+static void copyFromFlash(uint8_t* destination, const uint8_t* source, uint16_t length)
+{
+    //single bytes until the flash side is word aligned
+    while(length > 0 && ((uintptr_t)source & 3))
     {
-        uint16_t val = (i + 1 < length) ? (data[i + 1] << 8) | data[i] : data[i];
-        flashWriteHalfword(flashAddress + i, val);
+        *destination++ = *source++;
+        length--;
+    }
+
+    if(((uintptr_t)destination & 3) == 0)
+    {
+        //both sides aligned, move whole words
+        while(length >= 4)
+        {
+            *(uint32_t*)destination = *(const uint32_t*)source;
+            destination += 4;
+            source += 4;
+            length -= 4;
+        }
+    }
+    else
+    {
+        //the M0 cannot store unaligned words, so load a word from flash and store its bytes
+        while(length >= 4)
+        {
+            uint32_t word = *(const uint32_t*)source;
+            destination[0] = word & 0xFF;
+            destination[1] = (word >> 8) & 0xFF;
+            destination[2] = (word >> 16) & 0xFF;
+            destination[3] = (word >> 24) & 0xFF;
+            destination += 4;
+            source += 4;
+            length -= 4;
+        }
+    }
+
+    //remaining tail bytes
+    while(length > 0)
+    {
+        *destination++ = *source++;
+        length--;
     }
-    flashLock();
-    return EEPROM_OK;
 }
 
-//reads data from the EEPROM
-int eepromRead(uint32_t virtualAddress, uint8_t* buffer, uint16_t length)
+//returns a read-only pointer to length bytes of the EEPROM, or NULL if the span is out of range
+const uint8_t* eepromView(uint32_t virtualAddress, uint16_t length)
 {
     //calcualte the flash address
-    uint32_t flashAddress = FLASH_PAGE_62_ADDRESS + virtualAddress;
+    uint32_t flashAddress = STORAGE_BASE_ADDRESS + virtualAddress;
     
     //check for validity of address
-    if (flashAddress + length > FLASH_PAGE_63_ADDRESS + FLASH_PAGE_SIZE) 
+    if (flashAddress + length > STORAGE_END_ADDRESS) 
     {
-        return EEPROM_INVALID_ADDRESS;
+        return NULL;
     }
+    return flashMapSpan(flashAddress, length);
+}
 
-    //read one halfword at a time
-    for (uint16_t i = 0; i < length; i += 2) 
+//reads data from the EEPROM
+int eepromRead(uint32_t virtualAddress, uint8_t* buffer, uint16_t length)
+{
+    const uint8_t* source = eepromView(virtualAddress, length);
+    if (!source) 
     {
-        uint16_t val = flashReadHalfword(flashAddress + i);
-        buffer[i] = val & 0xFF;
-        if (i + 1 < length) 
-        {
-            buffer[i + 1] = (val >> 8) & 0xFF;
-        }
+        return EEPROM_INVALID_ADDRESS;
     }
-    
+
+    copyFromFlash(buffer, source, length);
     return EEPROM_OK;
 }
-
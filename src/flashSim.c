@@ -0,0 +1,223 @@
+/*
+This module simulates the STM32 flash pages used by the diary so the storage code can run and be measured on a host machine.
+It replaces the hardware-specific functions of eepromDriver.c when HOST_BUILD is defined.
+*/
+
+#ifdef HOST_BUILD
+
+#include <stdio.h>
+#include <string.h>
+#include "stm32f0xx.h"
+#include "eepromDriver.h"
+#include "flashSim.h"
+
+//register mirror so code that polls FLASH->SR keeps working, starts out locked like after reset
+FLASH_TypeDef flashSimRegisters = { .CR = FLASH_CR_LOCK };
+
+static uint16_t simMemory[FLASH_SIM_SIZE / 2] __attribute__((aligned(4)));
+static FlashSimCostModel costModel =
+{
+    .eraseTimeUs = FLASH_SIM_DEFAULT_ERASE_US,
+    .programTimeUs = FLASH_SIM_DEFAULT_PROGRAM_US,
+    .readTimeNs = FLASH_SIM_DEFAULT_READ_NS
+};
+static FlashSimCounters counters;
+//halfwords that can still be programmed before the simulated power loss
+static uint32_t programsLeft = FLASH_SIM_NO_POWER_LOSS;
+
+//maps a flash address to its simulated halfword, NULL if outside the region or misaligned
+static uint16_t* simLocate(uint32_t address)
+{
+    if(address < FLASH_SIM_BASE_ADDRESS || address >= FLASH_SIM_BASE_ADDRESS + FLASH_SIM_SIZE || (address & 1))
+    {
+        return NULL;
+    }
+    return &simMemory[(address - FLASH_SIM_BASE_ADDRESS) / 2];
+}
+
+//erases the whole region, resets counters and optionally swaps in a new cost model
+void flashSimInit(const FlashSimCostModel* model)
+{
+    memset(simMemory, 0xFF, sizeof(simMemory));
+    memset(&counters, 0, sizeof(counters));
+    programsLeft = FLASH_SIM_NO_POWER_LOSS;
+    memset(&flashSimRegisters, 0, sizeof(flashSimRegisters));
+    flashSimRegisters.CR = FLASH_CR_LOCK;
+
+    if(model)
+    {
+        costModel = *model;
+    }
+}
+
+void flashSimSetCostModel(const FlashSimCostModel* model)
+{
+    costModel = *model;
+}
+
+void flashSimGetCounters(FlashSimCounters* out)
+{
+    *out = counters;
+}
+
+void flashSimResetCounters(void)
+{
+    memset(&counters, 0, sizeof(counters));
+}
+
+//loads a raw image of the region from a file, returns 0 on success
+int flashSimLoadImage(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if(!file)
+    {
+        return -1;
+    }
+    size_t got = fread(simMemory, 1, sizeof(simMemory), file);
+    fclose(file);
+    return (got == sizeof(simMemory)) ? 0 : -1;
+}
+
+//saves a raw image of the region to a file, returns 0 on success
+int flashSimSaveImage(const char* path)
+{
+    FILE* file = fopen(path, "wb");
+    if(!file)
+    {
+        return -1;
+    }
+    size_t put = fwrite(simMemory, 1, sizeof(simMemory), file);
+    fclose(file);
+    return (put == sizeof(simMemory)) ? 0 : -1;
+}
+
+//from now on only the next halfwords programs reach the flash, erases and later programs are lost
+//as if power failed there, the caller remounts from the image to see what a reset would find
+void flashSimPowerLossAfter(uint32_t halfwords)
+{
+    programsLeft = halfwords;
+}
+
+void flashUnlock(void)
+{
+    FLASH->CR &= ~FLASH_CR_LOCK;
+}
+
+void flashLock(void)
+{
+    FLASH->CR |= FLASH_CR_LOCK;
+}
+
+//erases the 2KB page containing pageAddress, same as the controller does with FLASH->AR
+void flashErasePage(uint32_t pageAddress)
+{
+    if(FLASH->CR & FLASH_CR_LOCK)
+    {
+        FLASH->SR |= FLASH_SR_WRPERR;
+        counters.programErrors++;
+        return;
+    }
+
+    uint16_t* page = simLocate(FLASH_PAGE_START(pageAddress));
+    if(!page)
+    {
+        printf("\r\nERASE VERIFY FAILED @ 0x%08lX", (unsigned long)pageAddress);
+        return;
+    }
+    if(programsLeft == 0)
+    {
+        return;
+    }
+
+    memset(page, 0xFF, FLASH_PAGE_SIZE);
+    counters.pageErases++;
+    counters.busyTimeNs += (uint64_t)costModel.eraseTimeUs * 1000;
+    FLASH->SR |= FLASH_SR_EOP;
+}
+
+//programs a run of halfwords under the F0 rules, same contract as the hardware flashProgramBurst
+int flashProgramBurst(uint32_t address, const uint8_t* data, uint16_t length, uint8_t options, uint32_t* programmed)
+{
+    for(uint16_t i = 0; i < length; i += 2)
+    {
+        uint16_t val = (i + 1 < length) ? (data[i + 1] << 8) | data[i] : data[i];
+        uint16_t* cell = simLocate(address + i);
+
+        if(!cell)
+        {
+            FLASH->SR |= FLASH_SR_PGERR;
+            counters.programErrors++;
+            return EEPROM_WRITE_FAILED;
+        }
+        if(val == 0xFFFF)
+        {
+            continue;
+        }
+        if((options & FLASH_PROGRAM_VERIFY_ERASED) && *cell == val)
+        {
+            continue;
+        }
+        if(FLASH->CR & FLASH_CR_LOCK)
+        {
+            FLASH->SR |= FLASH_SR_WRPERR;
+            counters.programErrors++;
+            return EEPROM_WRITE_PROTECTED;
+        }
+
+        //the F0 controller refuses anything but 0x0000 on a location that is not erased
+        if(*cell != 0xFFFF && val != 0x0000)
+        {
+            FLASH->SR |= FLASH_SR_PGERR;
+            counters.programErrors++;
+            return EEPROM_WRITE_FAILED;
+        }
+
+        if(programsLeft == 0)
+        {
+            continue;
+        }
+        if(programsLeft != FLASH_SIM_NO_POWER_LOSS)
+        {
+            programsLeft--;
+        }
+        *cell &= val;
+        counters.halfwordsProgrammed++;
+        counters.busyTimeNs += (uint64_t)costModel.programTimeUs * 1000;
+        FLASH->SR |= FLASH_SR_EOP;
+        (*programmed)++;
+    }
+    return EEPROM_OK;
+}
+
+uint16_t flashReadHalfword(uint32_t address)
+{
+    uint16_t* cell = simLocate(address);
+    counters.halfwordsRead++;
+    counters.busyTimeNs += costModel.readTimeNs;
+    return cell ? *cell : 0xFFFF;
+}
+
+//maps a span of the simulated region for direct reads, charging it as halfword reads
+const uint8_t* flashMapSpan(uint32_t address, uint16_t length)
+{
+    if(address < FLASH_SIM_BASE_ADDRESS || address + length > FLASH_SIM_BASE_ADDRESS + FLASH_SIM_SIZE)
+    {
+        return NULL;
+    }
+    uint32_t halfwords = (length + 1) / 2;
+    counters.halfwordsRead += halfwords;
+    counters.busyTimeNs += (uint64_t)halfwords * costModel.readTimeNs;
+    return (const uint8_t*)simMemory + (address - FLASH_SIM_BASE_ADDRESS);
+}
+
+uint32_t flashGetEraseCount(void)
+{
+    return counters.pageErases;
+}
+
+uint32_t flashGetBytesRead(void)
+{
+    return counters.halfwordsRead * 2;
+}
+
+#endif
@@ -0,0 +1,137 @@
+/*
+This module formats command output without printf: integers in decimal or hex, padded fields and text spans.
+Lines are built in a buffer and queued on the UART transmitter in one call, so no byte goes through
+newlib's stdio, and nothing here needs floating point or a varargs parser.
+*/
+
+#include <string.h>
+#include "format.h"
+#include "uartTx.h"
+
+static char lineText[FORMAT_LINE_SIZE];
+static FormatBuffer line;
+
+void formatInit(FormatBuffer* buffer, char* storage, uint16_t capacity)
+{
+    buffer->text = storage;
+    buffer->capacity = capacity;
+    buffer->length = 0;
+}
+
+//starts a new line in the shared buffer, only for the main loop since the buffer is not reentrant
+FormatBuffer* formatBegin(void)
+{
+    formatInit(&line, lineText, FORMAT_LINE_SIZE);
+    return &line;
+}
+
+//appends length bytes, whatever does not fit is sent ahead of it rather than cut off
+void formatSpan(FormatBuffer* buffer, const char* text, uint16_t length)
+{
+    while(length > 0)
+    {
+        if(buffer->length == buffer->capacity)
+        {
+            formatSend(buffer);
+        }
+        uint16_t room = buffer->capacity - buffer->length;
+        uint16_t count = (length < room) ? length : room;
+        memcpy(buffer->text + buffer->length, text, count);
+        buffer->length += count;
+        text += count;
+        length -= count;
+    }
+}
+
+void formatText(FormatBuffer* buffer, const char* text)
+{
+    formatSpan(buffer, text, strlen(text));
+}
+
+//right-aligned in width characters filled with pad, like %*lu or %0*lu, width 0 for no padding
+void formatUnsigned(FormatBuffer* buffer, uint32_t value, uint8_t width, char pad)
+{
+    //digits are produced lowest first, from the end of the field
+    char digits[10];
+    uint8_t count = 0;
+    do
+    {
+        digits[sizeof(digits) - 1 - count++] = '0' + value % 10;
+        value /= 10;
+    } while(value);
+
+    while(width > count)
+    {
+        formatSpan(buffer, &pad, 1);
+        width--;
+    }
+    formatSpan(buffer, digits + sizeof(digits) - count, count);
+}
+
+//right-aligned in width characters filled with spaces, like %*d
+void formatSigned(FormatBuffer* buffer, int32_t value, uint8_t width)
+{
+    if(value >= 0)
+    {
+        formatUnsigned(buffer, value, width, ' ');
+        return;
+    }
+
+    //the sign goes after the padding, so the magnitude is padded one narrower
+    uint32_t magnitude = -(uint32_t)value;
+    uint32_t scale = 10;
+    uint8_t count = 1;
+    while(count < 10 && magnitude >= scale)
+    {
+        scale *= 10;
+        count++;
+    }
+    while(width > count + 1)
+    {
+        formatSpan(buffer, " ", 1);
+        width--;
+    }
+    formatSpan(buffer, "-", 1);
+    formatUnsigned(buffer, magnitude, 0, ' ');
+}
+
+//upper case hex with exactly digits digits, like %08lX
+void formatHex(FormatBuffer* buffer, uint32_t value, uint8_t digits)
+{
+    static const char hexDigits[] = "0123456789ABCDEF";
+    char text[8];
+    if(digits > sizeof(text))
+    {
+        digits = sizeof(text);
+    }
+    for(uint8_t i = 0; i < digits; i++)
+    {
+        text[digits - 1 - i] = hexDigits[value & 0xF];
+        value >>= 4;
+    }
+    formatSpan(buffer, text, digits);
+}
+
+//a fixed point value kept as hundredths, printed as "whole.hh"
+void formatHundredths(FormatBuffer* buffer, uint32_t valueX100)
+{
+    formatUnsigned(buffer, valueX100 / 100, 0, ' ');
+    formatSpan(buffer, ".", 1);
+    formatUnsigned(buffer, valueX100 % 100, 2, '0');
+}
+
+//queues the buffer on the transmitter and empties it
+void formatSend(FormatBuffer* buffer)
+{
+    if(buffer->length > 0)
+    {
+        uartTxWrite(buffer->text, buffer->length);
+    }
+    buffer->length = 0;
+}
+
+//a constant line needs no buffer at all
+void formatPuts(const char* text)
+{
+    uartTxWrite(text, strlen(text));
+}
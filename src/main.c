@@ -8,17 +8,34 @@
 #include "tty.h"
 #include "serial.h"
 #include "rtc.h"
+#include "cycleCounter.h"
+#include "uartTx.h"
+#include "uartRx.h"
+#include "crypto.h"
+#include "format.h"
 
 //just set to 5423 temporarily for testing
 #define PASSWORD "5423"
 #define MAX_PW_ATTEMPTS 3
-#define FIFOSIZE 16
-
-char serfifo[FIFOSIZE];
-int seroffset = 0;
 volatile uint32_t msTicks = 0;
 void internal_clock();
 
+//reads one line into buffer without the newline, a line longer than the buffer is cut and the rest discarded
+//gets() has no bound, and a line can outgrow the line buffer now that it is handed out before its newline
+static void readLine(char* buffer, int size)
+{
+    int idx = 0;
+    char c;
+    while((c = getchar()) != '\n')
+    {
+        if(idx < size - 1)
+        {
+            buffer[idx++] = c;
+        }
+    }
+    buffer[idx] = '\0';
+}
+
 //password verification logic
 int verifyPassword()
 {
@@ -26,71 +43,67 @@ int verifyPassword()
     int attempts = 0;
     while(attempts < MAX_PW_ATTEMPTS)
     {
-        printf("\r\nPlease enter the password: ");
-        gets(input);
+        formatPuts("\r\nPlease enter the password: ");
+        readLine(input, sizeof(input));
         if(strcmp(input, PASSWORD) == 0)
         {
+            //the entry key comes from the password, so it is never stored on the device
+            cryptoDeriveSessionKey(input);
+            memset(input, 0, sizeof(input));
             return 1;
         }
         attempts++;
-        printf("\r\nIncorrect password (%d / %d attempts)", attempts, MAX_PW_ATTEMPTS);
+        FormatBuffer* line = formatBegin();
+        formatText(line, "\r\nIncorrect password (");
+        formatSigned(line, attempts, 0);
+        formatText(line, " / ");
+        formatSigned(line, MAX_PW_ATTEMPTS, 0);
+        formatText(line, " attempts)");
+        formatSend(line);
     }
-    printf("\r\nMax attempts reached. System locked.");
+    formatPuts("\r\nMax attempts reached. System locked.");
     return 0;
 }
 
 
-void enable_tty_interrupt(void) 
-{
-    /*
-    each time a char is received:
-    1. raise an interrupt every time the receive data register becomes not empty
-        - set the proper bit in the nvic iser as well
-    2. trigger a dma operation every time the receive data register becoems not empty
-        - do so by enabling dma mode for reception
-    */
-    USART5->CR1 |= USART_CR1_RXNEIE;
-    NVIC->ISER[0] |= (1 << USART3_8_IRQn);
-    USART5->CR3 |= USART_CR3_DMAR;
-
-    RCC->AHBENR |= RCC_AHBENR_DMA2EN;
-    DMA2->CSELR |= DMA2_CSELR_CH2_USART5_RX;
-    DMA2_Channel2->CCR &= ~DMA_CCR_EN;
-
-    DMA2_Channel2->CMAR = (uint32_t) serfifo;
-    DMA2_Channel2->CPAR = (uint32_t) &(USART5->RDR);
-    DMA2_Channel2->CNDTR = FIFOSIZE;
-    DMA2_Channel2->CCR &= ~DMA_CCR_DIR;
-    DMA2_Channel2->CCR &= ~(DMA_CCR_MSIZE | DMA_CCR_PSIZE);
-    DMA2_Channel2->CCR |= DMA_CCR_MINC; 
-    DMA2_Channel2->CCR |= DMA_CCR_CIRC;
-    DMA2_Channel2->CCR |= DMA_CCR_PL;
-    DMA2_Channel2->CCR |= DMA_CCR_TCIE;
-    DMA2_Channel2->CCR |= DMA_CCR_EN;
-}
-
 //works like line_buffer_getchar(), but does not check or clear ORE nor wait on new characters in USART
+//the receive interrupt only queues bytes, they are echoed and line-edited here in main context
+//a line that fills the line buffer without a newline is handed out as it stands, so a long pasted
+//entry streams through instead of waiting forever for a newline that has no room to arrive
 char interrupt_getchar() 
 {
-    while(fifo_newline(&input_fifo) == 0) 
+    tty_process_input();
+    while(fifo_newline(&input_fifo) == 0 && fifo_full(&input_fifo) == 0) 
     {
-        asm volatile ("wfi");
+        //reclaim flash a step at a time while waiting for input, sleep once nothing is left to do
+        if(!diaryBackgroundStep(DIARY_GC_STEP_US * (CYCLES_PER_MS / 1000)))
+        {
+            //masked, so a byte queued after the check still ends the wfi instead of waiting for the next one
+            __disable_irq();
+            if(!tty_input_pending())
+            {
+                asm volatile ("wfi");
+            }
+            __enable_irq();
+        }
+        tty_process_input();
     }
     // Return a character from the line buffer.
     char ch = fifo_remove(&input_fifo);
     return ch;
 }
 
-void USART3_8_IRQHandler(void) 
+//idle line and overrun interrupts from USART5, received bytes arrive through DMA
+RAMFUNC void USART3_8_IRQHandler(void) 
 {
-    while(DMA2_Channel2->CNDTR != sizeof serfifo - seroffset) 
-    {
-        if (!fifo_full(&input_fifo))
-        {
-            insert_echo_char(serfifo[seroffset]);
-        }
-        seroffset = (seroffset + 1) % sizeof serfifo;
-    }
+    uartRxHandleUsartInterrupt();
+}
+
+//shared by DMA1 channels 2-3 and DMA2 channels 1-2: USART5 transmit (channel 1) and receive (channel 2)
+RAMFUNC void DMA1_Ch2_3_DMA2_Ch1_2_IRQHandler(void)
+{
+    uartTxHandleDmaInterrupt();
+    uartRxHandleDmaInterrupt();
 }
 
 void init_usart5() 
@@ -125,15 +138,11 @@ void init_usart5()
 
 
 
+//queues the character for the DMA transmitter instead of waiting on TXE
 int __io_putchar(int c) 
 {
-    if (c == '\n') 
-    {  
-        while(!(USART5->ISR & USART_ISR_TXE));
-        USART5->TDR = '\r';
-    }
-    while(!(USART5->ISR & USART_ISR_TXE));
-    USART5->TDR = c;
+    char ch = c;
+    uartTxWrite(&ch, 1);
     return c;
 }
 
@@ -149,8 +158,12 @@ int main(void)
     //all clock and peripheral initializations 
     SystemCoreClockUpdate();
     internal_clock();
+    cycleCounterInit();
+    //vectors come from SRAM from here on, before any interrupt is enabled
+    flashInit();
     init_usart5();
-    enable_tty_interrupt();
+    uartTxInit();
+    uartRxInit();
     rtcInit();
 
     //turn off the buffering - first 1023 chars are displayed this way
@@ -159,8 +172,8 @@ int main(void)
     setbuf(stderr,0);
 
     //opening print statements
-    printf("\n ");
-    printf("\r\n=== Digital Diary System ===");
+    formatPuts("\n ");
+    formatPuts("\r\n=== Digital Diary System ===");
 
     //keep locked while password not verified
     if(!verifyPassword())
@@ -168,25 +181,33 @@ int main(void)
         //lock system
         while(1);
     }
-    printf("\r\nAccess granted!\n");
+    formatPuts("\r\nAccess granted!\n");
 
-    //initialize the eeprom
-    printf("\r\nInitializing EEPROM...\r\n");
-    flashUnlock();
-    flashErasePage(FLASH_PAGE_62_ADDRESS);
-    flashErasePage(FLASH_PAGE_63_ADDRESS);
-    flashLock();
+    //mount what is already in flash, this also builds the RAM index once instead of rescanning flash on every command
+    formatPuts("\r\nMounting diary...");
+    int entries = mountDiary();
+    DiaryMountStats mount;
+    getDiaryMountStats(&mount);
+    FormatBuffer* line = formatBegin();
+    formatText(line, "\r\nMounted ");
+    formatSigned(line, entries, 0);
+    formatText(line, " entries from ");
+    formatUnsigned(line, mount.pages, 0, ' ');
+    formatText(line, " pages in ");
+    formatUnsigned(line, mount.cycles / (CYCLES_PER_MS / 1000), 0, ' ');
+    formatText(line, " us\r\n");
+    formatSend(line);
 
     //after EEPROM initialization
-    printf("\rInitializing memory system...\n");
-    printf("\r\nDiary System Ready");
+    formatPuts("\rInitializing memory system...\n");
+    formatPuts("\r\nDiary System Ready");
     
     //input parsing logic
     while(1) 
     {
-        printf("\r\n> ");
+        formatPuts("\r\n> ");
         char cmd[32];
-        gets(cmd);
+        readLine(cmd, sizeof(cmd));
         
         if(strncmp(cmd, "write", 5) == 0) 
         {
@@ -198,15 +219,39 @@ int main(void)
         }
         else if(strncmp(cmd, "read ", 5) == 0) 
         {
-            handleReadCommand(atoi(cmd + 5));
+            handleReadCommand(strtoul(cmd + 5, NULL, 10));
+        }
+        else if(strncmp(cmd, "grep ", 5) == 0) 
+        {
+            handleGrepCommand(cmd + 5);
         }
         else if(strncmp(cmd, "delete ", 7) == 0) 
         {
-            handleDeleteCommand(atoi(cmd + 7));
+            handleDeleteCommand(strtoul(cmd + 7, NULL, 10));
         }
         else if(strncmp(cmd, "list", 4) == 0) 
         {
-            handleListCommand();
+            handleListCommand(cmd + 4);
+        }
+        else if(strncmp(cmd, "more", 4) == 0) 
+        {
+            handleMoreCommand();
+        }
+        else if(strncmp(cmd, "format", 6) == 0) 
+        {
+            handleFormatCommand();
+        }
+        else if(strncmp(cmd, "time", 4) == 0) 
+        {
+            handleTimeCommand(cmd + 4);
+        }
+        else if(strncmp(cmd, "stats", 5) == 0) 
+        {
+            handleStatsCommand();
+        }
+        else if(strncmp(cmd, "wear", 4) == 0) 
+        {
+            handleWearCommand();
         }
         else if (strncmp(cmd, "logout", 6) == 0) 
         {
@@ -214,13 +259,20 @@ int main(void)
         }
         else 
         {
-            printf("\r\nAvailable commands:");
-            printf("\r\n  write - Create new entry");
-            printf("\r\n  search <tag> - Find entries by tag");
-            printf("\r\n  read <index> - Read entry by index");
-            printf("\r\n  delete <index> - Delete entry by index");
-            printf("\r\n  list - Show all entries");
-            printf("\r\n  logout - Exit the diary system");
+            //one span for the whole menu
+            formatPuts("\r\nAvailable commands:"
+                "\r\n  write - Create new entry"
+                "\r\n  search <tag> - Find entries by tag"
+                "\r\n  read <n> - Read entry n, as numbered by list and search"
+                "\r\n  grep <text> - Find entries containing text"
+                "\r\n  delete <n> - Delete entry n, as numbered by list and search"
+                "\r\n  list [since <t> | between <t> <t> | last <n>] - Show entries, t is YYYY-MM-DD [HH:MM:SS]"
+                "\r\n  more - Show the next page of a listing"
+                "\r\n  format - Erase all entries"
+                "\r\n  time [YYYY-MM-DD HH:MM:SS] - Show or set the clock"
+                "\r\n  stats - Show and reset operation timings"
+                "\r\n  wear - Show flash wear and projected lifetime"
+                "\r\n  logout - Exit the diary system");
         }
     }
 }
\ No newline at end of file
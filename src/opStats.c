@@ -0,0 +1,84 @@
+/*
+This module keeps a latency histogram and flash traffic counters for each instrumented operation.
+The OP_STATS_BEGIN/OP_STATS_END hooks sample the cycle counter and the flash driver's read,
+program and erase counters around the operation and add the difference to its record.
+Buckets are powers of two in microseconds so one array covers a few us up to seconds.
+*/
+
+#include <string.h>
+#include "opStats.h"
+#include "cycleCounter.h"
+#include "eepromDriver.h"
+
+static OpStats opStats[OP_COUNT];
+
+static const char* const opNames[OP_COUNT] =
+{
+    "store", "erase", "find", "retrieve", "list"
+};
+
+static uint32_t halfwordsProgrammed(void)
+{
+    FlashProgramStats program;
+    flashGetProgramStats(&program);
+    return program.halfwords;
+}
+
+void opStatsBegin(OpStatsScope* scope)
+{
+    scope->bytesRead = flashGetBytesRead();
+    scope->halfwordsProgrammed = halfwordsProgrammed();
+    scope->pagesErased = flashGetEraseCount();
+    //sampled last so the counter reads are not part of the operation
+    scope->cycles = cycleCounterNow();
+}
+
+void opStatsEnd(const OpStatsScope* scope, OpStatsOperation operation)
+{
+    uint32_t cycles = cycleCounterNow() - scope->cycles;
+    OpStats* stats = &opStats[operation];
+
+    stats->calls++;
+    stats->totalCycles += cycles;
+    if(cycles > stats->maxCycles)
+    {
+        stats->maxCycles = cycles;
+    }
+    stats->bytesRead += flashGetBytesRead() - scope->bytesRead;
+    stats->bytesProgrammed += (halfwordsProgrammed() - scope->halfwordsProgrammed) * 2;
+    stats->pagesErased += flashGetEraseCount() - scope->pagesErased;
+
+    uint32_t us = cycles / (CYCLES_PER_MS / 1000);
+    uint8_t bucket = 0;
+    while(us > 1 && bucket < OP_STATS_BUCKETS - 1)
+    {
+        us >>= 1;
+        bucket++;
+    }
+    stats->buckets[bucket]++;
+}
+
+//moves the start of scope past everything since pause was sampled, so the operation does not count it
+void opStatsResume(OpStatsScope* scope, const OpStatsScope* pause)
+{
+    scope->bytesRead += flashGetBytesRead() - pause->bytesRead;
+    scope->halfwordsProgrammed += halfwordsProgrammed() - pause->halfwordsProgrammed;
+    scope->pagesErased += flashGetEraseCount() - pause->pagesErased;
+    //sampled last, like in opStatsBegin
+    scope->cycles += cycleCounterNow() - pause->cycles;
+}
+
+void opStatsGet(OpStatsOperation operation, OpStats* stats)
+{
+    *stats = opStats[operation];
+}
+
+const char* opStatsName(OpStatsOperation operation)
+{
+    return opNames[operation];
+}
+
+void opStatsReset(void)
+{
+    memset(opStats, 0, sizeof(opStats));
+}
@@ -1,29 +1,377 @@
 /*
-This module simulates a real-time clock using SysTick for timestamp generation in each entry
+This module keeps the time for entry timestamps on the F091's RTC peripheral.
+The calendar runs from the 32.768kHz LSE crystal (the LSI if the crystal does not start) in the
+backup domain, so it keeps counting through resets and needs no periodic interrupt.
+Timestamps are seconds since 1970, converted to and from the RTC's BCD calendar here.
+On host builds the time comes from the host clock plus an offset set by rtcSetTimestamp.
+
+A 1ms SysTick can be run as a probe around an operation to see how long interrupts were held off.
 */
 
+#include <stddef.h>
 #include "rtc.h"
+#include "cycleCounter.h"
 #include "stm32f0xx.h"
 
-static uint32_t simulatedTime = 0;
+typedef struct
+{
+    uint16_t year;
+    uint8_t month;
+    uint8_t day;
+    uint8_t hour;
+    uint8_t minute;
+    uint8_t second;
+} RtcCalendar;
+
+//days since 1970-01-01 for a civil date (proleptic Gregorian, the RTC's range only needs 2000-2099)
+static uint32_t daysFromCivil(uint32_t year, uint32_t month, uint32_t day)
+{
+    year -= month <= 2;
+    uint32_t era = year / 400;
+    uint32_t yearOfEra = year - era * 400;
+    uint32_t dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    uint32_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+static void calendarFromTimestamp(uint32_t timestamp, RtcCalendar* calendar)
+{
+    uint32_t days = timestamp / 86400;
+    uint32_t seconds = timestamp % 86400;
+    calendar->hour = seconds / 3600;
+    calendar->minute = seconds / 60 % 60;
+    calendar->second = seconds % 60;
+
+    //inverse of daysFromCivil
+    days += 719468;
+    uint32_t era = days / 146097;
+    uint32_t dayOfEra = days - era * 146097;
+    uint32_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    uint32_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    uint32_t monthIndex = (5 * dayOfYear + 2) / 153;
+    calendar->day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+    calendar->month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+    calendar->year = yearOfEra + era * 400 + (calendar->month <= 2);
+}
+
+static uint32_t timestampFromCalendar(const RtcCalendar* calendar)
+{
+    return daysFromCivil(calendar->year, calendar->month, calendar->day) * 86400
+        + calendar->hour * 3600 + calendar->minute * 60 + calendar->second;
+}
+
+//writes value as exactly digits decimal digits with leading zeros, returns the end of them
+static char* putDigits(char* text, uint16_t value, uint8_t digits)
+{
+    for(uint8_t i = digits; i > 0; i--)
+    {
+        text[i - 1] = '0' + value % 10;
+        value /= 10;
+    }
+    return text + digits;
+}
+
+void rtcFormatTimestamp(uint32_t timestamp, char* text)
+{
+    RtcCalendar calendar;
+    calendarFromTimestamp(timestamp, &calendar);
+    text = putDigits(text, calendar.year, 4);
+    *text++ = '-';
+    text = putDigits(text, calendar.month, 2);
+    *text++ = '-';
+    text = putDigits(text, calendar.day, 2);
+    *text++ = ' ';
+    text = putDigits(text, calendar.hour, 2);
+    *text++ = ':';
+    text = putDigits(text, calendar.minute, 2);
+    *text++ = ':';
+    text = putDigits(text, calendar.second, 2);
+    *text = '\0';
+}
+
+//reads a number after any spaces and checks the character after it is separator, 0 for any
+//returns the text after the separator, or NULL if either is missing
+static const char* readField(const char* text, unsigned* value, char separator)
+{
+    while(*text == ' ')
+    {
+        text++;
+    }
+    if(*text < '0' || *text > '9')
+    {
+        return NULL;
+    }
+    *value = 0;
+    while(*text >= '0' && *text <= '9')
+    {
+        //anything this large is out of range anyway, stop before it can wrap
+        if(*value < 100000)
+        {
+            *value = *value * 10 + (*text - '0');
+        }
+        text++;
+    }
+    if(separator == 0)
+    {
+        return text;
+    }
+    return (*text == separator) ? text + 1 : NULL;
+}
+
+//reads "YYYY-MM-DD HH:MM:SS", returns -1 if it is malformed or outside the RTC's range
+int rtcParseTimestamp(const char* text, uint32_t* timestamp)
+{
+    unsigned year, month, day, hour, minute, second;
+    if(!(text = readField(text, &year, '-')) || !(text = readField(text, &month, '-')) || !(text = readField(text, &day, 0))
+        || !(text = readField(text, &hour, ':')) || !(text = readField(text, &minute, ':')) || !readField(text, &second, 0))
+    {
+        return -1;
+    }
+    if(year < 2000 || year > 2099 || month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 59)
+    {
+        return -1;
+    }
+    RtcCalendar calendar = { year, month, day, hour, minute, second };
+    *timestamp = timestampFromCalendar(&calendar);
+
+    //days past the end of the month would roll over into the next one
+    RtcCalendar check;
+    calendarFromTimestamp(*timestamp, &check);
+    return (check.day == day) ? 0 : -1;
+}
+
+uint32_t rtcGetTimestamp(void)
+{
+    RtcTime time;
+    rtcGetTime(&time);
+    return time.seconds;
+}
+
+#ifndef HOST_BUILD
+
+//backup register value telling that the RTC was set up since the backup domain last lost power
+#define RTC_CONFIGURED 0x32F2
+//the LSE crystal can take a couple of seconds to start
+#define RTC_LSE_TIMEOUT_MS 3000
+//the asynchronous prescaler divides by 128, the synchronous one makes the 1Hz calendar clock
+#define RTC_ASYNC_PREDIV 127
+#define RTC_LSE_SYNC_PREDIV 255         //32768 / 128 / 256
+#define RTC_LSI_SYNC_PREDIV 311         //about 40000 / 128 / 312
+
+static volatile uint32_t tickCount = 0;
+static volatile uint32_t longestGap = 0;
+static volatile uint32_t lastTickCycles = 0;
+static uint32_t probeStartCycles = 0;
+
+static uint32_t toBcd(uint32_t value)
+{
+    return ((value / 10) << 4) | (value % 10);
+}
+
+static uint32_t fromBcd(uint32_t bcd)
+{
+    return (bcd >> 4) * 10 + (bcd & 0xF);
+}
+
+//the calendar registers can only be written in init mode with the write protection lifted
+static void enterInitMode(void)
+{
+    RTC->WPR = 0xCA;
+    RTC->WPR = 0x53;
+    RTC->ISR |= RTC_ISR_INIT;
+    while(!(RTC->ISR & RTC_ISR_INITF));
+}
+
+static void exitInitMode(void)
+{
+    RTC->ISR &= ~RTC_ISR_INIT;
+    RTC->WPR = 0xFF;
+    //init mode clears RSF, the shadow registers are stale until the next synchronisation
+    while(!(RTC->ISR & RTC_ISR_RSF));
+}
+
+static void writeCalendar(uint32_t timestamp)
+{
+    RtcCalendar calendar;
+    calendarFromTimestamp(timestamp, &calendar);
+    //1970-01-01 was a Thursday, the RTC counts Monday as 1
+    uint32_t weekday = (timestamp / 86400 + 3) % 7 + 1;
+
+    RTC->TR = (toBcd(calendar.hour) << 16) | (toBcd(calendar.minute) << 8) | toBcd(calendar.second);
+    RTC->DR = (toBcd(calendar.year - 2000) << 16) | (weekday << 13) | (toBcd(calendar.month) << 8) | toBcd(calendar.day);
+}
 
 void rtcInit(void)
 {
+    //the RTC lives in the backup domain, which is write protected after reset
+    RCC->APB1ENR |= RCC_APB1ENR_PWREN;
+    PWR->CR |= PWR_CR_DBP;
+
+    if((RCC->BDCR & RCC_BDCR_RTCEN) && RTC->BKP0R == RTC_CONFIGURED)
+    {
+        //still running from before the reset, only the LSI has to be restarted since it is not in the backup domain
+        if((RCC->BDCR & RCC_BDCR_RTCSEL) == RCC_BDCR_RTCSEL_1)
+        {
+            RCC->CSR |= RCC_CSR_LSION;
+            while(!(RCC->CSR & RCC_CSR_LSIRDY));
+        }
+        //a system reset clears RSF as well
+        while(!(RTC->ISR & RTC_ISR_RSF));
+        return;
+    }
+
+    //the clock source can only be chosen after a backup domain reset
+    RCC->BDCR |= RCC_BDCR_BDRST;
+    RCC->BDCR &= ~RCC_BDCR_BDRST;
+
+    RCC->BDCR |= RCC_BDCR_LSEON;
+    uint32_t startCycles = cycleCounterNow();
+    while(!(RCC->BDCR & RCC_BDCR_LSERDY) && cycleCounterNow() - startCycles < RTC_LSE_TIMEOUT_MS * CYCLES_PER_MS);
+
+    uint32_t syncPrescaler = RTC_LSE_SYNC_PREDIV;
+    if(RCC->BDCR & RCC_BDCR_LSERDY)
+    {
+        RCC->BDCR |= RCC_BDCR_RTCSEL_0;
+    }
+    else
+    {
+        //no crystal, the LSI is off by a few percent but keeps the calendar going
+        RCC->BDCR &= ~RCC_BDCR_LSEON;
+        RCC->CSR |= RCC_CSR_LSION;
+        while(!(RCC->CSR & RCC_CSR_LSIRDY));
+        RCC->BDCR |= RCC_BDCR_RTCSEL_1;
+        syncPrescaler = RTC_LSI_SYNC_PREDIV;
+    }
+    RCC->BDCR |= RCC_BDCR_RTCEN;
+
+    enterInitMode();
+    //the two prescalers have to be written separately, synchronous first
+    RTC->PRER = syncPrescaler;
+    RTC->PRER = syncPrescaler | (RTC_ASYNC_PREDIV << 16);
+    RTC->CR &= ~RTC_CR_FMT;
+    writeCalendar(RTC_FIRST_TIMESTAMP);
+    exitInitMode();
+    RTC->BKP0R = RTC_CONFIGURED;
+}
+
+void rtcGetTime(RtcTime* time)
+{
+    //reading SSR or TR locks the shadow registers until DR is read, so the three are one sample
+    uint32_t subseconds = RTC->SSR;
+    uint32_t tr = RTC->TR;
+    uint32_t dr = RTC->DR;
+    uint32_t syncPrescaler = RTC->PRER & RTC_PRER_PREDIV_S;
+
+    RtcCalendar calendar =
+    {
+        .year = 2000 + fromBcd((dr >> 16) & 0xFF),
+        .month = fromBcd((dr >> 8) & 0x1F),
+        .day = fromBcd(dr & 0x3F),
+        .hour = fromBcd((tr >> 16) & 0x3F),
+        .minute = fromBcd((tr >> 8) & 0x7F),
+        .second = fromBcd(tr & 0x7F)
+    };
+    time->seconds = timestampFromCalendar(&calendar);
+    //SSR counts down from the synchronous prescaler once per calendar second
+    time->milliseconds = (syncPrescaler - subseconds) * 1000 / (syncPrescaler + 1);
+}
+
+int rtcSetTimestamp(uint32_t timestamp)
+{
+    if(timestamp < RTC_FIRST_TIMESTAMP || timestamp > RTC_LAST_TIMESTAMP)
+    {
+        return -1;
+    }
+    enterInitMode();
+    writeCalendar(timestamp);
+    exitInitMode();
+    return 0;
+}
+
+//INITS is only set once the year is not 2000, where the calendar starts before it is set
+int rtcIsSet(void)
+{
+    return (RTC->ISR & RTC_ISR_INITS) != 0;
+}
+
+//from SRAM, so the probe is not held off by a flash erase or program
+RAMFUNC void SysTick_Handler(void)
+{
+    uint32_t now = cycleCounterNow();
+    if(tickCount > 0 && now - lastTickCycles > longestGap)
+    {
+        longestGap = now - lastTickCycles;
+    }
+    lastTickCycles = now;
+    tickCount++;
+}
+
+void rtcStartTickProbe(void)
+{
+    tickCount = 0;
+    longestGap = 0;
+    probeStartCycles = cycleCounterNow();
     SysTick_Config(SystemCoreClock / 1000);
 }
 
-uint32_t rtcGetTimestamp(void)
+void rtcStopTickProbe(RtcTickStats* stats)
+{
+    SysTick->CTRL = 0;
+    stats->ticks = tickCount;
+    stats->longestGapCycles = longestGap;
+    //every elapsed millisecond should have had a tick of its own
+    uint32_t expected = (cycleCounterNow() - probeStartCycles) / CYCLES_PER_MS;
+    stats->lostTicks = (expected > tickCount) ? expected - tickCount : 0;
+}
+
+#else
+
+#include <time.h>
+
+//difference between the diary's clock and the host's
+static int64_t hostOffset = 0;
+
+void rtcInit(void)
+{
+}
+
+void rtcGetTime(RtcTime* time)
 {
-    return simulatedTime;
-    simulatedTime++;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    time->seconds = (uint32_t)(now.tv_sec + hostOffset);
+    time->milliseconds = now.tv_nsec / 1000000;
 }
 
-void rtcSetTimestamp(uint32_t timestamp)
+int rtcSetTimestamp(uint32_t timestamp)
 {
-    simulatedTime = timestamp;
+    if(timestamp < RTC_FIRST_TIMESTAMP || timestamp > RTC_LAST_TIMESTAMP)
+    {
+        return -1;
+    }
+    hostOffset = (int64_t)timestamp - time(NULL);
+    return 0;
+}
+
+int rtcIsSet(void)
+{
+    return 1;
 }
 
 void SysTick_Handler(void)
 {
-    simulatedTime++;
-}
\ No newline at end of file
+}
+
+//there are no interrupts to hold off on the host
+void rtcStartTickProbe(void)
+{
+}
+
+void rtcStopTickProbe(RtcTickStats* stats)
+{
+    stats->ticks = 0;
+    stats->longestGapCycles = 0;
+    stats->lostTicks = 0;
+}
+
+#endif
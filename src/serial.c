@@ -9,6 +9,13 @@ This module handles the user commands via UART I/O
 #include <string.h>
 #include <stdlib.h>
 #include "eepromDriver.h"
+#include "compress.h"
+#include "cycleCounter.h"
+#include "uartTx.h"
+#include "uartRx.h"
+#include "rtc.h"
+#include "opStats.h"
+#include "format.h"
 
 //ignore all newlines
 static void flushInput(void)
@@ -19,40 +26,150 @@ static void flushInput(void)
     }
 }
 
+//fills buffer from the input until '#' or until it is full, returns the count and sets *ended at '#'
+static int readContent(char* buffer, int capacity, int* ended)
+{
+    int idx = 0;
+    *ended = 0;
+    while(idx < capacity)
+    {
+        char c = getchar();
+        if(c == '#')
+        {
+            *ended = 1;
+            break;
+        }
+        buffer[idx++] = c;
+    }
+    return idx;
+}
+
+//writes an entry that outgrew the line buffer, the buffer is reused for each chunk as it arrives
+//returns the stored length, or -1 after the rest of the input has been discarded
+static int streamLongEntry(const char* tag, char* content, int idx)
+{
+    DiaryWriter writer;
+    int ended = 0;
+    int failed = (beginDiaryWrite(&writer, tag, ENTRY_FLAGS_LIVE, MAX_CONTENT_LENGTH) != 0);
+    if(failed)
+    {
+        abortDiaryWrite(&writer);
+    }
+    
+    while(1)
+    {
+        if(!failed && appendDiaryWrite(&writer, (const uint8_t*)content, idx) != 0)
+        {
+            //give the slots back now, the rest of the input is only read to be discarded
+            abortDiaryWrite(&writer);
+            failed = 1;
+        }
+        if(ended)
+        {
+            break;
+        }
+        idx = readContent(content, MAX_CONTENT_LENGTH, &ended);
+    }
+
+    //the stored text includes its null terminator
+    const uint8_t terminator = '\0';
+    if(failed)
+    {
+        return -1;
+    }
+    if(appendDiaryWrite(&writer, &terminator, 1) != 0 || finishDiaryWrite(&writer) != 0)
+    {
+        abortDiaryWrite(&writer);
+        return -1;
+    }
+    return writer.meta.length;
+}
+
 void handleWriteCommand(void) 
 {
     char tag[MAX_TAG_LENGTH];
     char content[MAX_CONTENT_LENGTH];
-    char c;
-    int idx = 0;
+    int ended;
     
-    printf("\r\nEnter tag (max %d chars): ", MAX_TAG_LENGTH-1);
+    FormatBuffer* line = formatBegin();
+    formatText(line, "\r\nEnter tag (max ");
+    formatSigned(line, MAX_TAG_LENGTH - 1, 0);
+    formatText(line, " chars): ");
+    formatSend(line);
     fgets(tag, MAX_TAG_LENGTH, stdin);
     tag[strcspn(tag, "\n")] = '\0';
     
-    printf("\r\nEnter content (end with #): ");
-    while((c = getchar()) != '#' && idx < MAX_CONTENT_LENGTH-1) 
+    formatPuts("\r\nEnter content (end with #): ");
+    int idx = readContent(content, MAX_CONTENT_LENGTH - 1, &ended);
+    
+    DiaryWriteStats before, after;
+    getDiaryWriteStats(&before);
+    
+    //entries longer than the buffer go straight to flash uncompressed, in constant RAM
+    if(!ended)
     {
-        content[idx++] = c;
+        int stored = streamLongEntry(tag, content, idx);
+        getDiaryWriteStats(&after);
+        uint32_t cycles = after.cycles - before.cycles;
+        if(stored < 0)
+        {
+            formatPuts("\r\nFailed to save entry!\r\n");
+            return;
+        }
+        uint32_t bytesPerSecond = cycles ? (uint64_t)stored * CYCLES_PER_MS * 1000 / cycles : 0;
+        formatText(line, "\r\nEntry saved successfully! (");
+        formatSigned(line, stored, 0);
+        formatText(line, " bytes, ");
+        formatUnsigned(line, bytesPerSecond, 0, ' ');
+        formatText(line, " B/s)\r\n");
+        formatSend(line);
+        return;
     }
     content[idx] = '\0';
     
-    //encrypt before storing
-    xorEncrypt((uint8_t*)content, idx, ENCRYPTION_KEY);
+    //the stored text includes its null terminator
+    uint8_t* payload = (uint8_t*)content;
+    uint16_t length = idx + 1;
+    uint16_t flags = ENTRY_FLAGS_LIVE;
     
-    if(storeDiaryEntry(tag, (uint8_t*)content, idx + 1, 0) == 0) 
+    #if DIARY_COMPRESSION
+    //keep the compressed form only when it is actually smaller
+    uint8_t packed[MAX_CONTENT_LENGTH];
+    int packedLength = compressText(payload, length, packed, length - 1);
+    if(packedLength > 0) 
     {
-        printf("\r\nEntry saved successfully!\r\n");
+        payload = packed;
+        length = packedLength;
+        flags &= ~ENTRY_FLAG_COMPRESSED;
+    }
+    #endif
+    
+    //the store encrypts on the way into flash, compression has to come first since ciphertext does not compress
+    if(storeDiaryEntry(tag, payload, length, flags) == 0) 
+    {
+        getDiaryWriteStats(&after);
+        uint32_t cycles = after.cycles - before.cycles;
+        uint32_t bytesPerSecond = cycles ? (uint64_t)length * CYCLES_PER_MS * 1000 / cycles : 0;
+        formatText(line, "\r\nEntry saved successfully! (");
+        formatSigned(line, idx + 1, 0);
+        formatText(line, " -> ");
+        formatUnsigned(line, length, 0, ' ');
+        formatText(line, " bytes, ");
+        formatUnsigned(line, bytesPerSecond, 0, ' ');
+        formatText(line, " B/s)\r\n");
+        formatSend(line);
     } 
     else 
     {
-        printf("\r\nFailed to save entry!\r\n");
+        formatPuts("\r\nFailed to save entry!\r\n");
     }
 }
 
 void handleLogoutCommand(void) 
 {
-    printf("\r\nYou've been logged out. Goodbye!\r\n");
+    formatPuts("\r\nYou've been logged out. Goodbye!\r\n");
+    //let the transmit ring drain before the reset discards it
+    uartTxFlush();
     //soft reset the uC upon logout
     NVIC_SystemReset();
 }
@@ -60,140 +177,675 @@ void handleLogoutCommand(void)
 void handleSearchCommand(const char* tag) 
 {
     DiaryEntryIndex meta;
-    printf("\r\nSearching for '%s'...", tag);
+    TagSearch search;
+    int found = 0;
+    int index;
+    FormatBuffer* line = formatBegin();
+    formatText(line, "\r\nSearching for '");
+    formatText(line, tag);
+    formatText(line, "'...");
+    formatSend(line);
     
-    if(findEntryByTag(tag, &meta) == 0) 
+    //only the lookups are timed, printing each match is paused out of the scope
+    OP_STATS_BEGIN(find);
+    beginTagSearch(&search, tag);
+    while((index = nextTagMatch(&search, &meta)) >= 0) 
     {
-        printf("\r\n=== Found Entry ===");
-        printf("\r\nTag: %s", meta.tag);
-        printf("\r\nTimestamp: %lu", meta.timestamp);
-        printf("\r\nAddress: 0x%08lX", meta.flashAddress);
-        printf("\r\nSize: %d bytes\r\n", meta.length);
+        OP_STATS_PAUSE(output);
+        char when[RTC_TEXT_LENGTH];
+        rtcFormatTimestamp(meta.timestamp, when);
+        formatText(line, "\r\n=== Found Entry ");
+        formatUnsigned(line, meta.sequence, 0, ' ');
+        formatText(line, " ===\r\nTag: ");
+        formatText(line, meta.tag);
+        formatText(line, "\r\nTimestamp: ");
+        formatText(line, when);
+        formatText(line, "\r\nAddress: 0x");
+        formatHex(line, getEntryAddress(index), 8);
+        formatText(line, "\r\nSize: ");
+        formatUnsigned(line, meta.length, 0, ' ');
+        formatText(line, " bytes\r\n");
+        formatSend(line);
+        found++;
+        OP_STATS_RESUME(find, output);
     } 
-    else 
+    OP_STATS_END(find, OP_FIND);
+    
+    if(found == 0) 
+    {
+        formatPuts("\r\nNo matching entries found");
+    }
+}
+
+//scans the text of every entry for pattern and lists where it first occurs in each
+void handleGrepCommand(const char* pattern)
+{
+    ContentSearch search;
+    FormatBuffer* line = formatBegin();
+    uint32_t offset;
+    int found = 0;
+    int index;
+
+    if(beginContentSearch(&search, pattern) != 0)
+    {
+        formatText(line, "\r\nError: Pattern must be 1 to ");
+        formatUnsigned(line, TEXT_SEARCH_MAX_PATTERN, 0, ' ');
+        formatText(line, " characters");
+        formatSend(line);
+        return;
+    }
+    formatText(line, "\r\nScanning entries for '");
+    formatText(line, pattern);
+    formatText(line, "'...");
+    formatSend(line);
+
+    //printing is left out of the timing, only the scan counts towards the throughput
+    uint32_t scanCycles = 0;
+    uint32_t startCycles = cycleCounterNow();
+    while((index = nextContentMatch(&search, &offset)) >= 0)
+    {
+        scanCycles += cycleCounterNow() - startCycles;
+        formatText(line, "\r\nEntry ");
+        formatUnsigned(line, getCachedEntry(index)->sequence, 0, ' ');
+        formatText(line, ", offset ");
+        formatUnsigned(line, offset, 0, ' ');
+        formatSend(line);
+        found++;
+        startCycles = cycleCounterNow();
+    }
+    scanCycles += cycleCounterNow() - startCycles;
+
+    if(found == 0)
+    {
+        formatText(line, "\r\nNo entry contains '");
+        formatText(line, pattern);
+        formatText(line, "'");
+    }
+    uint32_t kbPerSecond = scanCycles ? (uint32_t)((uint64_t)search.bytesScanned * CYCLES_PER_MS / scanCycles) : 0;
+    formatText(line, "\r\nScanned ");
+    formatUnsigned(line, search.entriesScanned, 0, ' ');
+    formatText(line, " entries, ");
+    formatUnsigned(line, search.bytesScanned, 0, ' ');
+    formatText(line, " bytes in ");
+    formatUnsigned(line, scanCycles / (CYCLES_PER_MS / 1000), 0, ' ');
+    formatText(line, " us (");
+    formatUnsigned(line, kbPerSecond, 0, ' ');
+    formatText(line, " KB/s)");
+    formatSend(line);
+}
+
+//reports an entry number that resolves to nothing, returns its index position otherwise
+static int resolveEntryNumber(uint32_t number)
+{
+    int index = findEntryBySequence(number);
+    if(index < 0)
     {
-        printf("\r\nNo matching entries found");
+        FormatBuffer* line = formatBegin();
+        formatText(line, "\r\nError: No entry ");
+        formatUnsigned(line, number, 0, ' ');
+        formatSend(line);
     }
+    return index;
 }
 
-void handleReadCommand(uint16_t index) 
+//entries are addressed by the number list and search print, their sequence, since index positions
+//shift whenever compaction drops a tombstone, including while the prompt sits idle
+void handleReadCommand(uint32_t number) 
 {
     //add 1 for null term
     char content[MAX_CONTENT_LENGTH + 1];
     
-    printf("\r\nReading entry %d...", index);
+    FormatBuffer* line = formatBegin();
+    formatText(line, "\r\nReading entry ");
+    formatUnsigned(line, number, 0, ' ');
+    formatText(line, "...");
+    formatSend(line);
+    int index = resolveEntryNumber(number);
+    if(index < 0)
+    {
+        return;
+    }
     
-    //1 = decrypt
-    int len = retrieveDiaryEntry(index, content, 1);
+    //compressed entries are short and expanded in one go
+    const DiaryEntryIndex* meta = getCachedEntry(index);
+    if(meta && ENTRY_IS_COMPRESSED(meta))
+    {
+        //1 = decrypt
+        int len = retrieveDiaryEntry(index, content, sizeof(content), 1);
+        if(len > 0) 
+        {
+            formatText(line, "\r\n=== Entry ");
+            formatUnsigned(line, number, 0, ' ');
+            formatText(line, " ===\r\nContent: ");
+            formatText(line, content);
+            formatText(line, "\r\n================\r\n");
+            formatSend(line);
+        } 
+        else 
+        {
+            formatPuts("\r\nFailed to read entry");
+        }
+        return;
+    }
     
-    if(len > 0) 
+    //everything else is streamed out a buffer at a time, whatever its length
+    DiaryReader reader;
+    if(beginDiaryRead(&reader, index, 1) != 0)
     {
-        printf("\r\n=== Entry %d ===", index);
-        printf("\r\nContent: %s", content);
-        printf("\r\n================\r\n");
-    } 
-    else 
+        formatPuts("\r\nFailed to read entry");
+        return;
+    }
+    formatText(line, "\r\n=== Entry ");
+    formatUnsigned(line, number, 0, ' ');
+    formatText(line, " ===\r\nContent: ");
+    formatSend(line);
+    int len;
+    //only the reads are timed, sending each chunk is paused out of the scope
+    OP_STATS_BEGIN(retrieve);
+    while((len = readDiaryChunk(&reader, (uint8_t*)content, MAX_CONTENT_LENGTH)) > 0)
+    {
+        OP_STATS_PAUSE(output);
+        //the stored null terminator ends the last chunk
+        uartTxWrite(content, strnlen(content, len));
+        OP_STATS_RESUME(retrieve, output);
+    }
+    OP_STATS_END(retrieve, OP_RETRIEVE);
+    if(len < 0)
     {
-        printf("\r\nFailed to read entry");
+        formatPuts("\r\nError: Entry content is corrupt");
     }
+    formatPuts("\r\n================\r\n");
 }
 
-void handleDeleteCommand(uint16_t index) 
+void handleDeleteCommand(uint32_t number) 
 {
-    DiaryEntryIndex meta;
-    uint32_t metaAddress = FLASH_PAGE_62_ADDRESS + index * sizeof(DiaryEntryIndex);
+    FormatBuffer* line = formatBegin();
+    uint32_t startCycles = cycleCounterNow();
+    uint32_t erasesBefore = flashGetEraseCount();
+    int index = resolveEntryNumber(number);
+    if(index < 0)
+    {
+        return;
+    }
     
-    //read the existing metadata
-    if(eepromRead(metaAddress - FLASH_PAGE_62_ADDRESS, (uint8_t*)&meta, sizeof(meta)) != EEPROM_OK) 
+    //perform deletion by tombstoning the record, the space is reclaimed later, usually in the background while the prompt waits
+    int result = deleteDiaryEntry(index);
+    if(result < 0) 
     {
-        printf("\r\nError: Invalid entry index");
+        formatPuts("\r\nError: Invalid entry index");
         return;
     }
     
     //verify entry exists
-    if(meta.flashAddress == 0xFFFFFFFF) 
+    if(result > 0) 
     {
-        printf("\r\nEntry %d is already deleted", index);
+        formatText(line, "\r\nEntry ");
+        formatUnsigned(line, number, 0, ' ');
+        formatText(line, " is already deleted");
+        formatSend(line);
         return;
     }
     
-    //prepare deletion marker
-    DiaryEntryIndex deletedMarker;
-    memset(&deletedMarker, 0xFF, sizeof(DiaryEntryIndex));
-    
-    //perform deletioon
-    flashUnlock();
-    
-    //erase the entire page
-    flashErasePage(FLASH_PAGE_62_ADDRESS);
-    
-    //rewrite all entries except the deleted one
-    int count = getEntryCount();
-    for(int i = 0; i < count; i++) 
+    uint32_t elapsedUs = (cycleCounterNow() - startCycles) / (CYCLES_PER_MS / 1000);
+    formatText(line, "\r\nEntry ");
+    formatUnsigned(line, number, 0, ' ');
+    formatText(line, " deleted successfully! (");
+    formatUnsigned(line, elapsedUs, 0, ' ');
+    formatText(line, " us, ");
+    formatUnsigned(line, flashGetEraseCount() - erasesBefore, 0, ' ');
+    formatText(line, " page erases)");
+    formatSend(line);
+}
+
+//erases the whole diary after the user confirms, the only way entries are wiped in bulk
+void handleFormatCommand(void)
+{
+    char answer[8];
+    FormatBuffer* line = formatBegin();
+    formatText(line, "\r\nErase all ");
+    formatSigned(line, getEntryCount(), 0);
+    formatText(line, " entries? (y/n): ");
+    formatSend(line);
+    fgets(answer, sizeof(answer), stdin);
+    if(answer[0] != 'y' && answer[0] != 'Y')
     {
-        uint32_t currentAddr = FLASH_PAGE_62_ADDRESS + i * sizeof(DiaryEntryIndex);
-        
-        //skip the entry deleting
-        if(i == index) continue;
-        
-        //read existing entry
-        DiaryEntryIndex currentEntry;
-        eepromRead(currentAddr - FLASH_PAGE_62_ADDRESS, (uint8_t*)&currentEntry, sizeof(currentEntry));
+        formatPuts("\r\nFormat cancelled");
+        return;
+    }
+
+    uint32_t startCycles = cycleCounterNow();
+    uint32_t erasesBefore = flashGetEraseCount();
+    rtcStartTickProbe();
+    if(formatDiary() != EEPROM_OK)
+    {
+        formatPuts("\r\nError: Format failed");
+        return;
+    }
+    uint32_t elapsedMs = (cycleCounterNow() - startCycles) / CYCLES_PER_MS;
+    formatText(line, "\r\nDiary formatted (");
+    formatUnsigned(line, flashGetEraseCount() - erasesBefore, 0, ' ');
+    formatText(line, " page erases, ");
+    formatUnsigned(line, elapsedMs, 0, ' ');
+    formatText(line, " ms)");
+
+    //the tick keeps running through the erases only if the vectors and handler are in SRAM
+    RtcTickStats ticks;
+    rtcStopTickProbe(&ticks);
+    formatText(line, "\r\nTick latency during format: longest gap ");
+    formatUnsigned(line, ticks.longestGapCycles / (CYCLES_PER_MS / 1000), 0, ' ');
+    formatText(line, " us, ");
+    formatUnsigned(line, ticks.lostTicks, 0, ' ');
+    formatText(line, " ticks lost");
+    formatSend(line);
+}
+
+//reads "YYYY-MM-DD HH:MM:SS" or just "YYYY-MM-DD" (midnight) from text, sets span to the seconds it covers
+//returns the text after it, or NULL if there is no valid time
+static const char* parseListTime(const char* text, uint32_t* timestamp, uint32_t* span)
+{
+    char buffer[RTC_TEXT_LENGTH];
+    while(*text == ' ')
+    {
+        text++;
+    }
+    strncpy(buffer, text, RTC_TEXT_LENGTH - 1);
+    buffer[RTC_TEXT_LENGTH - 1] = '\0';
+    if(strlen(buffer) == RTC_TEXT_LENGTH - 1 && rtcParseTimestamp(buffer, timestamp) == 0)
+    {
+        *span = 1;
+        return text + RTC_TEXT_LENGTH - 1;
+    }
+
+    //a date alone stands for the whole day
+    strcpy(buffer + 10, " 00:00:00");
+    if(strlen(text) >= 10 && (text[10] == '\0' || text[10] == ' ') && rtcParseTimestamp(buffer, timestamp) == 0)
+    {
+        *span = 24 * 60 * 60;
+        return text + 10;
+    }
+    return NULL;
+}
+
+//index positions per page of a listing, a page costs the same however large the store is
+#define LIST_PAGE_ENTRIES 8
+//one page of lines, about 80 bytes per entry plus the page header and footer
+#define LIST_PAGE_BUFFER 768
+
+//the listing "more" continues
+static EntryCursor listCursor;
+static uint16_t listPage = 0;
+static uint16_t listPages = 0;
+static char listBuffer[LIST_PAGE_BUFFER];
+
+//formats the next page of the listing into listBuffer and hands it to the transmitter as one span
+static void sendListPage(void)
+{
+    int first;
+    OP_STATS_BEGIN(list);
+    int end = nextCursorWindow(&listCursor, LIST_PAGE_ENTRIES, &first);
+    if(end < 0)
+    {
+        OP_STATS_END(list, OP_LIST);
+        formatPuts("\r\nNo more entries");
+        return;
+    }
+
+    //a page that somehow outgrows the buffer goes out in pieces instead of being cut off
+    FormatBuffer page;
+    formatInit(&page, listBuffer, LIST_PAGE_BUFFER);
+    listPage++;
+    formatText(&page, "\r\n--- Page ");
+    formatUnsigned(&page, listPage, 0, ' ');
+    formatText(&page, " of ");
+    formatUnsigned(&page, (listPage > listPages) ? listPage : listPages, 0, ' ');
+    formatText(&page, " ---");
+    for(int i = first; i < end; i++) 
+    {
+        const DiaryEntryIndex* meta = getCachedEntry(i);
         
-        //rewrite it
-        uint8_t *entryBytes = (uint8_t*)&currentEntry;
-        for(uint16_t j = 0; j < sizeof(DiaryEntryIndex); j += 2) 
+        //show only show valid entries instead of deleted ones also
+        if(!ENTRY_IS_DELETED(meta)) 
         {
-            uint16_t val = (j+1 < sizeof(DiaryEntryIndex)) ?(entryBytes[j+1] << 8) | entryBytes[j] : entryBytes[j];
-
-            flashWriteHalfword(currentAddr + j, val);
-            while(!(FLASH->SR & FLASH_SR_EOP_Msk));
-            FLASH->SR = FLASH_SR_EOP_Msk;
+            char when[RTC_TEXT_LENGTH];
+            rtcFormatTimestamp(meta->timestamp, when);
+            formatText(&page, "\r\n");
+            formatUnsigned(&page, meta->sequence, 4, ' ');
+            formatText(&page, ": [");
+            formatText(&page, meta->tag);
+            formatText(&page, "] (Time: ");
+            formatText(&page, when);
+            formatText(&page, ", Size: ");
+            formatUnsigned(&page, meta->length, 0, ' ');
+            formatText(&page, " bytes)");
         }
     }
-    
-    //write the deleted marker at the end
-    uint32_t newAddr = FLASH_PAGE_62_ADDRESS + count * sizeof(DiaryEntryIndex);
-    uint8_t *markerBytes = (uint8_t*)&deletedMarker;
-    for(uint16_t j = 0; j < sizeof(DiaryEntryIndex); j += 2) 
+    if(!entryCursorDone(&listCursor))
     {
-        uint16_t val = (j + 1 < sizeof(DiaryEntryIndex)) ? (markerBytes[j+1] << 8) | markerBytes[j] : markerBytes[j];
+        formatText(&page, "\r\n(\"more\" for the next page)");
+    }
+    OP_STATS_END(list, OP_LIST);
+    formatSend(&page);
+}
 
-        flashWriteHalfword(newAddr + j, val);
-        while(!(FLASH->SR & FLASH_SR_EOP_Msk));
-        FLASH->SR = FLASH_SR_EOP_Msk;
+//starts a paged listing of the entries from index first up to but not including end
+static void startListing(int first, int end)
+{
+    if(first >= end)
+    {
+        listPages = 0;
+        openEntryCursor(&listCursor, 0, 0);
+        formatPuts("\r\nNo entries in that range");
+        return;
     }
-    
-    //lock flash and display proper statement
-    flashLock();
-    printf("\r\nEntry %d deleted successfully!", index);
+    openEntryCursor(&listCursor, first, end);
+    listPage = 0;
+    listPages = (end - first + LIST_PAGE_ENTRIES - 1) / LIST_PAGE_ENTRIES;
+    sendListPage();
 }
 
-void handleListCommand(void) 
+//shows the next page of the last listing
+void handleMoreCommand(void)
+{
+    sendListPage();
+}
+
+//lists every entry, or "since <time>", "between <time> <time>" (both inclusive) or "last <n>", a page at a time
+//entries are in time order, so a range is found by binary search instead of a pass over the whole index
+void handleListCommand(const char* argument) 
 {
     int count = getEntryCount();
-    if(count == 0) 
+    if(getLiveEntryCount() == 0) 
     {
-        printf("\r\nNo entries found");
+        formatPuts("\r\nNo entries found");
         return;
     }
-    
-    printf("\r\n=== Entries (%d) ===", count);
-    
-    for(int i = 0; i < count; i++) 
+
+    while(*argument == ' ')
     {
-        DiaryEntryIndex meta;
-        uint32_t metaAddress = FLASH_PAGE_62_ADDRESS + (i * sizeof(DiaryEntryIndex));
-        
-        if(eepromRead(metaAddress - FLASH_PAGE_62_ADDRESS, (uint8_t*)&meta, sizeof(meta)) == EEPROM_OK) 
+        argument++;
+    }
+    uint32_t from, to, span;
+    const char* rest;
+    FormatBuffer* line = formatBegin();
+    if(*argument == '\0')
+    {
+        formatText(line, "\r\n=== Entries (");
+        formatUnsigned(line, getLiveEntryCount(), 0, ' ');
+        formatText(line, ") ===");
+        formatSend(line);
+        startListing(0, count);
+    }
+    else if(strncmp(argument, "since ", 6) == 0 && parseListTime(argument + 6, &from, &span))
+    {
+        formatText(line, "\r\n=== Entries since ");
+        formatText(line, argument + 6);
+        formatText(line, " ===");
+        formatSend(line);
+        startListing(findFirstEntrySince(from), count);
+    }
+    else if(strncmp(argument, "between ", 8) == 0 && (rest = parseListTime(argument + 8, &from, &span)) && parseListTime(rest, &to, &span))
+    {
+        formatText(line, "\r\n=== Entries between ");
+        formatText(line, argument + 8);
+        formatText(line, " ===");
+        formatSend(line);
+        startListing(findFirstEntrySince(from), findFirstEntrySince(to + span));
+    }
+    else if(strncmp(argument, "last ", 5) == 0 && atoi(argument + 5) > 0)
+    {
+        formatText(line, "\r\n=== Last ");
+        formatSigned(line, atoi(argument + 5), 0);
+        formatText(line, " entries ===");
+        formatSend(line);
+        startListing(findLastLiveEntries(atoi(argument + 5)), count);
+    }
+    else
+    {
+        formatPuts("\r\nUsage: list [since <time> | between <time> <time> | last <n>], time is YYYY-MM-DD [HH:MM:SS]");
+    }
+}
+
+//dumps the per-operation latency histograms and flash traffic, then starts them over
+void handleStatsCommand(void)
+{
+    FormatBuffer* line = formatBegin();
+    #if OP_STATS
+    formatPuts("\r\n=== Operation stats ===");
+    for(int op = 0; op < OP_COUNT; op++)
+    {
+        OpStats stats;
+        opStatsGet(op, &stats);
+        if(stats.calls == 0)
+        {
+            continue;
+        }
+        uint32_t meanUs = (uint32_t)(stats.totalCycles / stats.calls / (CYCLES_PER_MS / 1000));
+        formatText(line, "\r\n");
+        formatText(line, opStatsName(op));
+        formatText(line, ": ");
+        formatUnsigned(line, stats.calls, 0, ' ');
+        formatText(line, " calls, mean ");
+        formatUnsigned(line, meanUs, 0, ' ');
+        formatText(line, " us, max ");
+        formatUnsigned(line, stats.maxCycles / (CYCLES_PER_MS / 1000), 0, ' ');
+        formatText(line, " us, flash read ");
+        formatUnsigned(line, stats.bytesRead, 0, ' ');
+        formatText(line, " B, programmed ");
+        formatUnsigned(line, stats.bytesProgrammed, 0, ' ');
+        formatText(line, " B, erased ");
+        formatUnsigned(line, stats.pagesErased, 0, ' ');
+        formatText(line, " pages");
+
+        //one line of non-empty buckets, each labelled with its lower bound in us
+        formatText(line, "\r\n  us:");
+        for(int bucket = 0; bucket < OP_STATS_BUCKETS; bucket++)
         {
-            //show only show valid entries instead of deleted ones also
-            if(meta.flashAddress != 0xFFFFFFFF) 
+            if(stats.buckets[bucket])
             {
-                printf("\r\n%2d: [%s] (Time: %lu, Size: %d bytes)",  i, meta.tag, meta.timestamp, meta.length);
+                formatText(line, " ");
+                formatUnsigned(line, bucket ? 1UL << bucket : 0, 0, ' ');
+                formatText(line, "+:");
+                formatUnsigned(line, stats.buckets[bucket], 0, ' ');
             }
         }
+        formatSend(line);
     }
+    opStatsReset();
+    #else
+    formatPuts("\r\nOperation stats are compiled out (OP_STATS=0)");
+    #endif
+
+    //slots programmed per slot of new content since the diary was mounted
+    DiaryWriteStats write;
+    DiaryCompactionStats compaction;
+    getDiaryWriteStats(&write);
+    getDiaryCompactionStats(&compaction);
+    uint32_t amplification = DIARY_WRITE_AMPLIFICATION_X100(&write, &compaction);
+    formatText(line, "\r\nWrite amplification ");
+    formatHundredths(line, amplification);
+    formatText(line, " (");
+    formatUnsigned(line, write.slots, 0, ' ');
+    formatText(line, " new slots, ");
+    formatUnsigned(line, compaction.slotsMoved, 0, ' ');
+    formatText(line, " moved, ");
+    formatUnsigned(line, compaction.backgroundSlotsMoved, 0, ' ');
+    formatText(line, " in the background, ");
+    formatUnsigned(line, compaction.pagesRecycled, 0, ' ');
+    formatText(line, " pages recycled)");
+
+    //how much flash reading the RAM index and the tag hashes saved since boot
+    IndexCacheStats cache;
+    getIndexCacheStats(&cache);
+    formatText(line, "\r\nIndex cache: ");
+    formatUnsigned(line, cache.loads, 0, ' ');
+    formatText(line, " loads, ");
+    formatUnsigned(line, cache.recordReads, 0, ' ');
+    formatText(line, " records read, ");
+    formatUnsigned(line, cache.recordReadsAvoided, 0, ' ');
+    formatText(line, " served from RAM, ");
+    formatUnsigned(line, cache.tagSearches, 0, ' ');
+    formatText(line, " tag searches (");
+    formatUnsigned(line, cache.bloomRejects, 0, ' ');
+    formatText(line, " rejected by the bloom filter, ");
+    formatUnsigned(line, cache.tagCandidates, 0, ' ');
+    formatText(line, " candidates compared)");
+
+    //burst programming rate, busy-wait time included
+    FlashProgramStats program;
+    flashGetProgramStats(&program);
+    formatText(line, "\r\nFlash programming: ");
+    formatUnsigned(line, program.halfwords, 0, ' ');
+    formatText(line, " halfwords in ");
+    formatUnsigned(line, program.batches, 0, ' ');
+    formatText(line, " bursts, ");
+    formatUnsigned(line, program.halfwordsPerMs, 0, ' ');
+    formatText(line, " halfwords/ms, ");
+    formatUnsigned(line, program.errors, 0, ' ');
+    formatText(line, " errors");
+
+    //input lost to a full line buffer or to overruns shows up here
+    UartRxStats rx;
+    uartRxGetStats(&rx);
+    formatText(line, "\r\nUART receive: ");
+    formatUnsigned(line, rx.bytesReceived, 0, ' ');
+    formatText(line, " bytes in ");
+    formatUnsigned(line, rx.spans, 0, ' ');
+    formatText(line, " spans (");
+    formatUnsigned(line, rx.idleEvents, 0, ' ');
+    formatText(line, " idle, ");
+    formatUnsigned(line, rx.dmaEvents, 0, ' ');
+    formatText(line, " DMA interrupts), ");
+    formatUnsigned(line, rx.overruns, 0, ' ');
+    formatText(line, " overruns, ");
+    formatUnsigned(line, rx.droppedBytes, 0, ' ');
+    formatText(line, " bytes dropped");
+
+    //CPU time spent putting output on the wire since the last stats, against the old TXE busy-wait
+    UartTxStats tx;
+    uartTxGetStats(&tx);
+    uartTxResetStats();
+    uint32_t cyclesPerByteX100 = tx.bytesQueued ? (uint32_t)((uint64_t)tx.cpuCycles * 100 / tx.bytesQueued) : 0;
+    formatText(line, "\r\nUART transmit: ");
+    formatUnsigned(line, tx.bytesQueued, 0, ' ');
+    formatText(line, " bytes in ");
+    formatUnsigned(line, tx.dmaTransfers, 0, ' ');
+    formatText(line, " DMA runs, ");
+    formatUnsigned(line, tx.cpuCycles / (CYCLES_PER_MS / 1000), 0, ' ');
+    formatText(line, " us queueing, ");
+    formatHundredths(line, cyclesPerByteX100);
+    formatText(line, " cycles/byte (");
+    formatUnsigned(line, UART_TX_POLLED_CYCLES_PER_BYTE, 0, ' ');
+    formatText(line, " busy-waiting on TXE)");
+
+    CompressionStats compression;
+    getCompressionStats(&compression);
+    uint32_t ratio = compression.bytesIn ? (uint32_t)((uint64_t)compression.bytesOut * 100 / compression.bytesIn) : 0;
+    formatText(line, "\r\nCompression: ");
+    formatUnsigned(line, compression.entriesCompressed, 0, ' ');
+    formatText(line, " entries, ");
+    formatUnsigned(line, compression.bytesIn, 0, ' ');
+    formatText(line, " -> ");
+    formatUnsigned(line, compression.bytesOut, 0, ' ');
+    formatText(line, " bytes (");
+    formatUnsigned(line, ratio, 0, ' ');
+    formatText(line, "%) in ");
+    formatUnsigned(line, compression.compressCycles / (CYCLES_PER_MS / 1000), 0, ' ');
+    formatText(line, " us, ");
+    formatUnsigned(line, compression.bytesDecompressed, 0, ' ');
+    formatText(line, " bytes expanded in ");
+    formatUnsigned(line, compression.decompressCycles / (CYCLES_PER_MS / 1000), 0, ' ');
+    formatText(line, " us");
+    formatSend(line);
+}
+
+//shows the erase count of every page, the lifetime write amplification and how long the flash should last at this rate
+void handleWearCommand(void)
+{
+    StorageWearStats wear;
+    StorageLifetimeStats lifetime;
+    storageGetWearStats(&wear);
+    storageGetLifetimeStats(&lifetime);
+
+    //the page grid is longer than the line buffer, it goes out in pieces as the buffer fills
+    FormatBuffer* line = formatBegin();
+    formatText(line, "\r\n=== Flash wear ===\r\nPage erases: min ");
+    formatUnsigned(line, wear.minErases, 0, ' ');
+    formatText(line, ", max ");
+    formatUnsigned(line, wear.maxErases, 0, ' ');
+    formatText(line, ", total ");
+    formatUnsigned(line, wear.totalErases, 0, ' ');
+    formatText(line, " (rated ");
+    formatUnsigned(line, STORAGE_ERASE_ENDURANCE, 0, ' ');
+    formatText(line, " per page)");
+    for(uint16_t page = 0; page < STORAGE_PAGE_COUNT; page++)
+    {
+        if(page % 8 == 0)
+        {
+            formatText(line, "\r\n");
+            formatUnsigned(line, page, 3, ' ');
+            formatText(line, ":");
+        }
+        formatText(line, " ");
+        formatUnsigned(line, storagePageEraseCount(page), 5, ' ');
+    }
+
+    //physical bytes per logical byte since the counters were first stamped, not just since reset
+    uint32_t amplification = lifetime.logicalBytes ? (uint32_t)((uint64_t)lifetime.physicalBytes * 100 / lifetime.logicalBytes) : 0;
+    formatText(line, "\r\nLifetime: ");
+    formatUnsigned(line, lifetime.logicalBytes, 0, ' ');
+    formatText(line, " bytes stored, ");
+    formatUnsigned(line, lifetime.physicalBytes, 0, ' ');
+    formatText(line, " bytes programmed, write amplification ");
+    formatHundredths(line, amplification);
+
+    uint32_t days = storageProjectedDaysLeft(rtcGetTimestamp());
+    if(days == STORAGE_STAMP_UNKNOWN)
+    {
+        formatText(line, "\r\nProjected lifetime: not enough history yet");
+    }
+    else
+    {
+        char since[RTC_TEXT_LENGTH];
+        rtcFormatTimestamp(lifetime.firstErasedAt, since);
+        formatText(line, "\r\nProjected lifetime: about ");
+        formatUnsigned(line, days, 0, ' ');
+        formatText(line, " days until the most worn page reaches ");
+        formatUnsigned(line, STORAGE_ERASE_ENDURANCE, 0, ' ');
+        formatText(line, " erases (rate since ");
+        formatText(line, since);
+        formatText(line, ")");
+    }
+    formatSend(line);
+}
+
+//shows the RTC time, or sets it from "YYYY-MM-DD HH:MM:SS"
+void handleTimeCommand(const char* argument)
+{
+    while(*argument == ' ')
+    {
+        argument++;
+    }
+    if(*argument != '\0')
+    {
+        uint32_t timestamp;
+        if(rtcParseTimestamp(argument, &timestamp) != 0 || rtcSetTimestamp(timestamp) != 0)
+        {
+            formatPuts("\r\nError: Expected YYYY-MM-DD HH:MM:SS between 2000 and 2099");
+            return;
+        }
+    }
+
+    RtcTime now;
+    char text[RTC_TEXT_LENGTH];
+    rtcGetTime(&now);
+    rtcFormatTimestamp(now.seconds, text);
+    FormatBuffer* line = formatBegin();
+    formatText(line, "\r\nTime: ");
+    formatText(line, text);
+    formatText(line, ".");
+    formatUnsigned(line, now.milliseconds, 3, '0');
+    formatText(line, rtcIsSet() ? "" : " (not set, use time YYYY-MM-DD HH:MM:SS)");
+    formatSend(line);
 }
 
 //parse the input commands
@@ -214,7 +866,7 @@ void parseCommand(const char* input)
     }
     else if(strncmp(input, "read ", 5) == 0) 
     {
-        handleReadCommand(atoi(input + 5));
+        handleReadCommand(strtoul(input + 5, NULL, 10));
     }
     else if(strncmp(input, "logout", 6) == 0) 
     {
@@ -222,7 +874,7 @@ void parseCommand(const char* input)
     }
     else 
     {
-        printf("\r\nUnknown command");
+        formatPuts("\r\nUnknown command");
     }
     flushInput();
 }
\ No newline at end of file
@@ -0,0 +1,412 @@
+/*
+This module manages the pages of the storage region: erase counts, the free pool, the page being
+filled and the choice of the next page to recycle. It knows nothing about diary entries.
+*/
+
+#include <string.h>
+#include "storage.h"
+#include "eepromDriver.h"
+#include "opStats.h"
+#include "rtc.h"
+#include <stddef.h>
+
+_Static_assert(sizeof(StoragePageHeader) == STORAGE_SLOT_SIZE, "a page header has to fill exactly one slot");
+
+//RAM copy of every page header plus how much of each page is written and how much of that is dead
+static uint32_t pageErases[STORAGE_PAGE_COUNT];
+static uint32_t pageSequence[STORAGE_PAGE_COUNT];
+//slots written including the header, 0 if the page has no valid header yet
+//only the active page is ever written past its fill, the blank tail of a closed page counts as dead
+static uint8_t pageFill[STORAGE_PAGE_COUNT];
+static uint8_t pageDead[STORAGE_PAGE_COUNT];
+static uint16_t activePage = STORAGE_NO_PAGE;
+static uint32_t nextSequence = 1;
+
+//lifetime counters: physical bytes are the newest header stamp plus what flashProgram counted since it was taken
+static uint32_t logicalBytes = 0;
+static uint32_t physicalBase = 0;
+static uint32_t halfwordsAtBase = 0;
+static uint32_t firstErasedAt = STORAGE_STAMP_UNKNOWN;
+
+static uint32_t programmedHalfwords(void)
+{
+    FlashProgramStats program;
+    flashGetProgramStats(&program);
+    return program.halfwords;
+}
+
+static uint32_t physicalBytes(void)
+{
+    return physicalBase + (programmedHalfwords() - halfwordsAtBase) * 2;
+}
+
+static const StoragePageHeader* pageHeader(uint16_t page)
+{
+    return (const StoragePageHeader*)flashMapSpan(STORAGE_PAGE_ADDRESS(page), sizeof(StoragePageHeader));
+}
+
+//1 if all bytes of the slot are still erased
+static int slotIsBlank(uint16_t slot)
+{
+    const uint32_t* words = (const uint32_t*)flashMapSpan(STORAGE_SLOT_ADDRESS(slot), STORAGE_SLOT_SIZE);
+    for(int i = 0; i < STORAGE_SLOT_SIZE / 4; i++)
+    {
+        if(words[i] != 0xFFFFFFFF)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//erases a page and stamps a fresh header carrying its erase count and the lifetime counters forward
+int storageRecyclePage(uint16_t page)
+{
+    uint32_t address = STORAGE_PAGE_ADDRESS(page);
+    OP_STATS_BEGIN(erase);
+    flashUnlock();
+    flashErasePage(address);
+    flashLock();
+    OP_STATS_END(erase, OP_ERASE);
+
+    StoragePageHeader header;
+    memset(&header, 0xFF, sizeof(header));
+    header.magic = STORAGE_PAGE_MAGIC;
+    header.eraseCount = ++pageErases[page];
+    header.sequenceFloor = nextSequence;
+    //part of the header write the erase needs anyway, so keeping the counters costs no extra erase
+    header.logicalBytes = logicalBytes;
+    header.physicalBytes = physicalBytes();
+    header.erasedAt = rtcGetTimestamp();
+    if(firstErasedAt == STORAGE_STAMP_UNKNOWN)
+    {
+        firstErasedAt = header.erasedAt;
+    }
+    header.firstErasedAt = firstErasedAt;
+    int result = flashProgram(address, (const uint8_t*)&header, sizeof(header), 0);
+
+    pageSequence[page] = STORAGE_SEQUENCE_FREE;
+    pageFill[page] = (result == EEPROM_OK) ? STORAGE_FIRST_DATA_SLOT : 0;
+    pageDead[page] = 0;
+    if(activePage == page)
+    {
+        activePage = STORAGE_NO_PAGE;
+    }
+    return result;
+}
+
+//erases the whole region, every page keeps its erase count
+int storageFormat(void)
+{
+    int result = EEPROM_OK;
+    storageScanPages();
+    for(uint16_t page = 0; page < STORAGE_PAGE_COUNT; page++)
+    {
+        if(storageRecyclePage(page) != EEPROM_OK)
+        {
+            result = EEPROM_ERROR;
+        }
+    }
+    activePage = STORAGE_NO_PAGE;
+    return result;
+}
+
+//rebuilds the page table from the headers in flash
+void storageScanPages(void)
+{
+    uint32_t highestErases = 0;
+    uint32_t highestSequence = 0;
+    uint32_t highestFloor = 0;
+    activePage = STORAGE_NO_PAGE;
+
+    for(uint16_t page = 0; page < STORAGE_PAGE_COUNT; page++)
+    {
+        const StoragePageHeader* header = pageHeader(page);
+        pageDead[page] = 0;
+        if(header->magic != STORAGE_PAGE_MAGIC)
+        {
+            //never formatted, or reset between erase and header, it gets recycled before use
+            pageErases[page] = 0;
+            pageSequence[page] = STORAGE_SEQUENCE_FREE;
+            pageFill[page] = 0;
+            continue;
+        }
+        pageErases[page] = header->eraseCount;
+        pageSequence[page] = header->sequence;
+        if(header->eraseCount > highestErases)
+        {
+            highestErases = header->eraseCount;
+        }
+        if(header->sequenceFloor != STORAGE_SEQUENCE_FREE && header->sequenceFloor > highestFloor)
+        {
+            highestFloor = header->sequenceFloor;
+        }
+        //the counters only grow, so the largest stamp is the newest, and RAM may already be ahead of it
+        if(header->physicalBytes != STORAGE_STAMP_UNKNOWN && header->physicalBytes > physicalBytes())
+        {
+            physicalBase = header->physicalBytes;
+            halfwordsAtBase = programmedHalfwords();
+            if(header->logicalBytes > logicalBytes)
+            {
+                logicalBytes = header->logicalBytes;
+            }
+        }
+        if(header->firstErasedAt < firstErasedAt)
+        {
+            firstErasedAt = header->firstErasedAt;
+        }
+
+        //a free page is only written after its sequence is stamped, so it has nothing past the header
+        if(header->sequence == STORAGE_SEQUENCE_FREE)
+        {
+            pageFill[page] = STORAGE_FIRST_DATA_SLOT;
+            continue;
+        }
+
+        //the write pointer is just past the last data slot that is not blank
+        uint8_t fill = STORAGE_DATA_END_SLOT;
+        uint16_t first = page * STORAGE_SLOTS_PER_PAGE;
+        while(fill > STORAGE_FIRST_DATA_SLOT && slotIsBlank(first + fill - 1))
+        {
+            fill--;
+        }
+        pageFill[page] = fill;
+
+        //the newest page that still has room is where writing continues
+        if(header->sequence >= highestSequence)
+        {
+            highestSequence = header->sequence;
+            activePage = (fill < STORAGE_DATA_END_SLOT) ? page : STORAGE_NO_PAGE;
+        }
+    }
+
+    for(uint16_t page = 0; page < STORAGE_PAGE_COUNT; page++)
+    {
+        //a lost erase count is assumed to be as high as any other, so the allocator does not favour it
+        if(pageFill[page] == 0)
+        {
+            pageErases[page] = highestErases;
+        }
+        //only the newest page is written to again, the blank tail of older ones is lost until recycled
+        if(pageSequence[page] != STORAGE_SEQUENCE_FREE && page != activePage)
+        {
+            pageDead[page] += STORAGE_DATA_END_SLOT - pageFill[page];
+        }
+    }
+    //sequences never go back, not even after a format erased every page that used them
+    nextSequence = (highestFloor > highestSequence) ? highestFloor : highestSequence + 1;
+}
+
+//fills order with the pages in use, oldest first, and returns how many there are
+int storagePagesInOrder(uint16_t* order)
+{
+    int count = 0;
+    for(uint16_t page = 0; page < STORAGE_PAGE_COUNT; page++)
+    {
+        if(pageSequence[page] == STORAGE_SEQUENCE_FREE)
+        {
+            continue;
+        }
+        //insertion sort, the region only has a few dozen pages
+        int i = count++;
+        while(i > 0 && pageSequence[order[i - 1]] > pageSequence[page])
+        {
+            order[i] = order[i - 1];
+            i--;
+        }
+        order[i] = page;
+    }
+    return count;
+}
+
+//stops filling the active page, slots it never used are lost until the page is recycled
+static void closeActivePage(void)
+{
+    if(activePage == STORAGE_NO_PAGE)
+    {
+        return;
+    }
+    pageDead[activePage] += STORAGE_DATA_END_SLOT - pageFill[activePage];
+    activePage = STORAGE_NO_PAGE;
+}
+
+//starts filling the least erased free page, returns STORAGE_NO_PAGE if there is none
+uint16_t storageOpenPage(void)
+{
+    uint16_t best = STORAGE_NO_PAGE;
+    for(uint16_t page = 0; page < STORAGE_PAGE_COUNT; page++)
+    {
+        if(pageSequence[page] != STORAGE_SEQUENCE_FREE)
+        {
+            continue;
+        }
+        if(best == STORAGE_NO_PAGE || pageErases[page] < pageErases[best])
+        {
+            best = page;
+        }
+    }
+    if(best == STORAGE_NO_PAGE)
+    {
+        return STORAGE_NO_PAGE;
+    }
+
+    //a page without a valid header (or with leftovers from a reset) is erased first
+    if(pageFill[best] != STORAGE_FIRST_DATA_SLOT && storageRecyclePage(best) != EEPROM_OK)
+    {
+        return STORAGE_NO_PAGE;
+    }
+
+    //the sequence field is still erased, so it can be stamped without another erase
+    uint32_t sequence = nextSequence++;
+    uint32_t address = STORAGE_PAGE_ADDRESS(best) + offsetof(StoragePageHeader, sequence);
+    if(flashProgram(address, (const uint8_t*)&sequence, sizeof(sequence), 0) != EEPROM_OK)
+    {
+        return STORAGE_NO_PAGE;
+    }
+    closeActivePage();
+    pageSequence[best] = sequence;
+    activePage = best;
+    return best;
+}
+
+//hands out the next slot of the page being filled, STORAGE_NO_SLOT once it is full
+uint16_t storageTakeSlot(void)
+{
+    if(activePage == STORAGE_NO_PAGE || pageFill[activePage] >= STORAGE_DATA_END_SLOT)
+    {
+        return STORAGE_NO_SLOT;
+    }
+    return activePage * STORAGE_SLOTS_PER_PAGE + pageFill[activePage]++;
+}
+
+uint16_t storageSlotsLeft(void)
+{
+    if(activePage == STORAGE_NO_PAGE)
+    {
+        return 0;
+    }
+    return STORAGE_DATA_END_SLOT - pageFill[activePage];
+}
+
+uint16_t storageActivePage(void)
+{
+    return activePage;
+}
+
+uint16_t storageFreePageCount(void)
+{
+    uint16_t count = 0;
+    for(uint16_t page = 0; page < STORAGE_PAGE_COUNT; page++)
+    {
+        if(pageSequence[page] == STORAGE_SEQUENCE_FREE)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+uint16_t storagePageFill(uint16_t page)
+{
+    return pageFill[page];
+}
+
+uint16_t storagePageDead(uint16_t page)
+{
+    return pageDead[page];
+}
+
+//a number for a slot of a page in use that no other slot ever gets, and that rises in the order slots are taken
+//pages are opened with rising sequences and never reopened before an erase, which gives them a new one
+uint32_t storageSlotSequence(uint16_t slot)
+{
+    return pageSequence[STORAGE_PAGE_OF_SLOT(slot)] * STORAGE_SLOTS_PER_PAGE + slot % STORAGE_SLOTS_PER_PAGE;
+}
+
+//records count slots starting at slot as no longer holding anything live
+void storageMarkDead(uint16_t slot, uint16_t count)
+{
+    pageDead[STORAGE_PAGE_OF_SLOT(slot)] += count;
+}
+
+//the page to recycle next: most dead slots, the less worn one on a tie, STORAGE_NO_PAGE if none has any
+//the page being filled and exclude (a page still being written to) are never picked
+uint16_t storagePickVictim(uint16_t exclude)
+{
+    uint16_t best = STORAGE_NO_PAGE;
+    for(uint16_t page = 0; page < STORAGE_PAGE_COUNT; page++)
+    {
+        if(page == activePage || page == exclude || pageSequence[page] == STORAGE_SEQUENCE_FREE || pageDead[page] == 0)
+        {
+            continue;
+        }
+        if(best == STORAGE_NO_PAGE || pageDead[page] > pageDead[best] || (pageDead[page] == pageDead[best] && pageErases[page] < pageErases[best]))
+        {
+            best = page;
+        }
+    }
+    return best;
+}
+
+uint32_t storagePageEraseCount(uint16_t page)
+{
+    return pageErases[page];
+}
+
+void storageGetWearStats(StorageWearStats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->minErases = 0xFFFFFFFF;
+    for(uint16_t page = 0; page < STORAGE_PAGE_COUNT; page++)
+    {
+        if(pageErases[page] < stats->minErases)
+        {
+            stats->minErases = pageErases[page];
+        }
+        if(pageErases[page] > stats->maxErases)
+        {
+            stats->maxErases = pageErases[page];
+        }
+        stats->totalErases += pageErases[page];
+        if(pageSequence[page] == STORAGE_SEQUENCE_FREE)
+        {
+            stats->freePages++;
+        }
+        else
+        {
+            stats->pagesInUse++;
+        }
+    }
+}
+
+//adds content bytes the owner stored, the logical side of write amplification
+void storageCountLogical(uint16_t bytes)
+{
+    logicalBytes += bytes;
+}
+
+void storageGetLifetimeStats(StorageLifetimeStats* stats)
+{
+    stats->logicalBytes = logicalBytes;
+    stats->physicalBytes = physicalBytes();
+    stats->firstErasedAt = firstErasedAt;
+}
+
+//days until the most worn page reaches STORAGE_ERASE_ENDURANCE at the erase rate seen since firstErasedAt
+//0 once a page is past it, STORAGE_STAMP_UNKNOWN while the history is too short to say
+uint32_t storageProjectedDaysLeft(uint32_t now)
+{
+    StorageWearStats wear;
+    storageGetWearStats(&wear);
+    if(wear.maxErases >= STORAGE_ERASE_ENDURANCE)
+    {
+        return 0;
+    }
+    if(firstErasedAt == STORAGE_STAMP_UNKNOWN || now < firstErasedAt + STORAGE_MIN_PROJECTION_SECONDS || wear.maxErases == 0)
+    {
+        return STORAGE_STAMP_UNKNOWN;
+    }
+    uint64_t secondsLeft = (uint64_t)(STORAGE_ERASE_ENDURANCE - wear.maxErases) * (now - firstErasedAt) / wear.maxErases;
+    uint64_t days = secondsLeft / 86400;
+    return (days < STORAGE_STAMP_UNKNOWN) ? (uint32_t)days : STORAGE_STAMP_UNKNOWN - 1;
+}
@@ -2,7 +2,6 @@
 This module provides low-level hardware and timing functions for the user interface.
 */
 #include "stm32f0xx.h"
-#include <stdio.h>
 #include <string.h> // for memmove()
 
 void nano_wait(unsigned int n) {
@@ -69,20 +68,6 @@ void print(const char str[])
     }
 }
 
-void printfloat(float f)
-{
-    char buf[10];
-    snprintf(buf, 10, "%f", f);
-    for(int i=1; i<10; i++) {
-        if (buf[i] == '.') {
-            // Combine the decimal point into the previous digit.
-            buf[i-1] |= 0x80;
-            memcpy(&buf[i], &buf[i+1], 10-i-1);
-        }
-    }
-    print(buf);
-}
-
 void append_segments(char val) {
     for (int i = 0; i < 7; i++) {
         set_digit_segments(i, msg[i+1] & 0xff);
@@ -56,6 +56,7 @@ This module provides minimal system call implementations to enable standard I/O
 #include <time.h>
 #include <sys/time.h>
 #include <sys/times.h>
+#include "uartTx.h"
 
 
 //#undef errno
@@ -106,13 +107,8 @@ return len;
 
 int _write(int file, char *ptr, int len)
 {
-	int DataIdx;
-
-	for (DataIdx = 0; DataIdx < len; DataIdx++)
-	{
-		__io_putchar(*ptr++);
-	}
-	return len;
+	/* Hand the whole span to the DMA transmit ring */
+	return uartTxWrite(ptr, len);
 }
 
 
@@ -0,0 +1,71 @@
+/*
+This module finds a fixed pattern in text that arrives a chunk at a time, using Boyer-Moore-Horspool.
+The last pattern length minus one bytes of each chunk are carried into the next, so a match
+across a chunk boundary is still found and nothing larger than one window is ever buffered.
+*/
+
+#include <string.h>
+#include "textSearch.h"
+
+//pattern lengths and skips are kept in bytes
+_Static_assert(TEXT_SEARCH_MAX_PATTERN <= 255, "TEXT_SEARCH_MAX_PATTERN has to fit the uint8_t length and shift table");
+
+//builds the skip table, returns -1 for an empty pattern or one longer than TEXT_SEARCH_MAX_PATTERN
+int textSearchInit(TextSearch* search, const char* pattern)
+{
+    size_t length = strlen(pattern);
+    if(length == 0 || length > TEXT_SEARCH_MAX_PATTERN)
+    {
+        return -1;
+    }
+    memcpy(search->pattern, pattern, length);
+    search->length = length;
+
+    //a byte not in the pattern skips it entirely, the last pattern byte does not count
+    memset(search->shift, length, sizeof(search->shift));
+    for(size_t i = 0; i + 1 < length; i++)
+    {
+        search->shift[search->pattern[i]] = length - 1 - i;
+    }
+    textSearchRestart(search);
+    return 0;
+}
+
+//forgets the previous stream, the next chunk starts at offset 0
+void textSearchRestart(TextSearch* search)
+{
+    search->held = 0;
+    search->offset = 0;
+}
+
+//searches the next chunk of the stream, returns the stream offset of the first match in it or -1
+int32_t textSearchFeed(TextSearch* search, const uint8_t* data, uint16_t length)
+{
+    uint8_t m = search->length;
+    while(length > 0)
+    {
+        uint16_t take = (length < TEXT_SEARCH_WINDOW) ? length : TEXT_SEARCH_WINDOW;
+        memcpy(search->buffer + search->held, data, take);
+        uint16_t n = search->held + take;
+        data += take;
+        length -= take;
+
+        uint16_t position = 0;
+        while(position + m <= n)
+        {
+            uint8_t last = search->buffer[position + m - 1];
+            if(last == search->pattern[m - 1] && memcmp(search->buffer + position, search->pattern, m - 1) == 0)
+            {
+                return search->offset + position;
+            }
+            position += search->shift[last];
+        }
+
+        //a match can only still start in the last m - 1 bytes
+        uint16_t keep = (n < m - 1) ? n : m - 1;
+        memmove(search->buffer, search->buffer + n - keep, keep);
+        search->offset += n - keep;
+        search->held = keep;
+    }
+    return -1;
+}
@@ -6,17 +6,58 @@ This module manages UART input buffering and line editing
 #include <stdio.h>
 #include "tty.h"
 #include "fifo.h"
+#include "uartTx.h"
 
 struct fifo input_fifo;  // input buffer
 int echo_mode = 1;       // should we echo input characters?
 int line_mode = 1;       // should we wait for a newline?
 
+// Received bytes not yet echoed, filled by the RX interrupt and emptied by tty_process_input().
+static char rx_pending[128];
+static volatile uint8_t pending_head = 0;
+static volatile uint8_t pending_tail = 0;
+
+//=======================================================================
+// Echo output, only ever called in main context, so it waits for ring
+// space instead of dropping bytes when the transmitter is behind.
+// Every echo string is a literal, so its length comes from sizeof
+// instead of a strlen() call into the C library in flash.
 //=======================================================================
-// Simply write a string one char at a time.
+#define putstr(s) uartTxWrite((s), sizeof(s) - 1)
+
+static void echochar(char ch) {
+    uartTxWrite(&ch, 1);
+}
+
 //=======================================================================
-static void putstr(const char *s) {
-    while(*s)
-        __io_putchar(*s++);
+// Queue a received byte, this is all the RX interrupt does with it.
+// Returns 0 if the queue is full and the byte is lost.
+//=======================================================================
+RAMFUNC int tty_queue_char(char ch) {
+    uint8_t next = (pending_tail + 1) % sizeof rx_pending;
+    if (next == pending_head)
+        return 0;
+    rx_pending[pending_tail] = ch;
+    pending_tail = next;
+    return 1;
+}
+
+//=======================================================================
+// Return 1 if received bytes are waiting for tty_process_input().
+//=======================================================================
+int tty_input_pending(void) {
+    return pending_head != pending_tail;
+}
+
+//=======================================================================
+// Echo and line-edit the queued bytes into the line buffer.
+// Bytes stay queued while the line buffer is full.
+//=======================================================================
+void tty_process_input(void) {
+    while (pending_head != pending_tail && !fifo_full(&input_fifo)) {
+        insert_echo_char(rx_pending[pending_head]);
+        pending_head = (pending_head + 1) % sizeof rx_pending;
+    }
 }
 
 //=======================================================================
@@ -43,16 +84,16 @@ void insert_echo_char(char ch) {
         }
         return; // Don't put a backspace into buffer.
     } else if (ch == '\n') {
-        __io_putchar('\n');
+        echochar('\n');
     } else if (ch == 0){
         putstr("^0");
     } else if (ch == 28) {
         putstr("^\\");
     } else if (ch < 32) {
-        __io_putchar('^');
-        __io_putchar('A'-1+ch);
+        echochar('^');
+        echochar('A'-1+ch);
     } else {
-        __io_putchar(ch);
+        echochar(ch);
     }
     fifo_insert(&input_fifo, ch);
 }
@@ -0,0 +1,115 @@
+/*
+This module receives on USART5 into a circular DMA ring and moves whole spans into the tty's receive queue.
+It is interrupted on an idle line (end of a burst) and when the DMA ring is half or completely full,
+instead of once per received character.
+The interrupt path runs from SRAM, so the ring is still drained while a flash erase stalls the CPU's
+fetches from flash.
+*/
+
+#include "stm32f0xx.h"
+#include "uartRx.h"
+#include "tty.h"
+
+//ring positions wrap with %, which is a mask only for a power of two, anything else calls a division routine in flash
+_Static_assert((UART_RX_DMA_SIZE & (UART_RX_DMA_SIZE - 1)) == 0, "UART_RX_DMA_SIZE has to be a power of two");
+
+static char rxRing[UART_RX_DMA_SIZE];
+//next ring position to move into the receive queue
+static uint16_t rxOffset = 0;
+static UartRxStats rxStats;
+
+void uartRxInit(void) 
+{
+    /*
+    characters are moved by DMA as they arrive:
+    1. the DMA channel writes into rxRing circularly and interrupts at half and full
+    2. the USART interrupts when the line goes idle so a short burst is picked up right away
+    3. overrun errors also interrupt so they can be counted
+    */
+    RCC->AHBENR |= RCC_AHBENR_DMA2EN;
+    DMA2->CSELR |= DMA2_CSELR_CH2_USART5_RX;
+    DMA2_Channel2->CCR &= ~DMA_CCR_EN;
+
+    DMA2_Channel2->CMAR = (uint32_t) rxRing;
+    DMA2_Channel2->CPAR = (uint32_t) &(USART5->RDR);
+    DMA2_Channel2->CNDTR = UART_RX_DMA_SIZE;
+    DMA2_Channel2->CCR &= ~DMA_CCR_DIR;
+    DMA2_Channel2->CCR &= ~(DMA_CCR_MSIZE | DMA_CCR_PSIZE);
+    DMA2_Channel2->CCR |= DMA_CCR_MINC; 
+    DMA2_Channel2->CCR |= DMA_CCR_CIRC;
+    DMA2_Channel2->CCR |= DMA_CCR_PL;
+    DMA2_Channel2->CCR |= DMA_CCR_HTIE | DMA_CCR_TCIE;
+    DMA2_Channel2->CCR |= DMA_CCR_EN;
+
+    USART5->CR1 &= ~USART_CR1_RXNEIE;
+    USART5->CR1 |= USART_CR1_IDLEIE;
+    USART5->CR3 |= USART_CR3_EIE;
+    USART5->CR3 |= USART_CR3_DMAR;
+
+    NVIC->ISER[0] |= (1 << USART3_8_IRQn);
+    NVIC->ISER[0] |= (1 << DMA1_Ch2_3_DMA2_Ch1_2_IRQn);
+}
+
+//moves everything the DMA has written since the last call into the receive queue
+RAMFUNC static void drainRing(void)
+{
+    uint16_t position = UART_RX_DMA_SIZE - DMA2_Channel2->CNDTR;
+    if(position == UART_RX_DMA_SIZE)
+    {
+        position = 0;
+    }
+    if(position == rxOffset)
+    {
+        return;
+    }
+    rxStats.spans++;
+
+    while(rxOffset != position) 
+    {
+        //one contiguous run at a time, up to the write position or the end of the ring
+        uint16_t end = (position > rxOffset) ? position : UART_RX_DMA_SIZE;
+        for(uint16_t i = rxOffset; i < end; i++)
+        {
+            //echo and line editing happen later in main context, see tty_process_input
+            if(!tty_queue_char(rxRing[i]))
+            {
+                rxStats.droppedBytes++;
+            }
+        }
+        rxStats.bytesReceived += end - rxOffset;
+        rxOffset = end % UART_RX_DMA_SIZE;
+    }
+}
+
+//idle line and error interrupt from USART5
+RAMFUNC void uartRxHandleUsartInterrupt(void)
+{
+    uint32_t status = USART5->ISR;
+    if(status & USART_ISR_ORE)
+    {
+        USART5->ICR = USART_ICR_ORECF;
+        rxStats.overruns++;
+    }
+    if(status & USART_ISR_IDLE)
+    {
+        USART5->ICR = USART_ICR_IDLECF;
+        rxStats.idleEvents++;
+    }
+    drainRing();
+}
+
+//half and full transfer interrupt from DMA2 channel 2
+RAMFUNC void uartRxHandleDmaInterrupt(void)
+{
+    if(DMA2->ISR & (DMA_ISR_HTIF2 | DMA_ISR_TCIF2))
+    {
+        DMA2->IFCR = DMA_IFCR_CGIF2;
+        rxStats.dmaEvents++;
+        drainRing();
+    }
+}
+
+void uartRxGetStats(UartRxStats* stats)
+{
+    *stats = rxStats;
+}
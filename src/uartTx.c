@@ -0,0 +1,199 @@
+/*
+This module transmits on USART5 through a ring buffer drained by DMA2 channel 1, so printing never busy-waits on TXE.
+Writers copy whole spans into the ring and return, the DMA completion interrupt starts the next run.
+Everything the DMA completion interrupt reaches runs from SRAM, see ramFunc.h.
+On host builds each transfer is written to stdout and completes immediately.
+*/
+
+#include <stdio.h>
+#include "uartTx.h"
+#include "cycleCounter.h"
+#include "stm32f0xx.h"
+
+//ring positions wrap with %, which is a mask only for a power of two, anything else calls a division routine in flash
+_Static_assert((UART_TX_RING_SIZE & (UART_TX_RING_SIZE - 1)) == 0, "UART_TX_RING_SIZE has to be a power of two");
+
+static char txRing[UART_TX_RING_SIZE];
+//next slot to fill
+static volatile uint16_t txHead = 0;
+//first byte not yet sent
+static volatile uint16_t txTail = 0;
+//bytes handed to the transfer in progress
+static volatile uint16_t txInFlight = 0;
+static UartTxStats txStats;
+
+RAMFUNC static void transferComplete(void);
+
+#ifndef HOST_BUILD
+
+//the ring is shared with the DMA completion interrupt, so updates run with interrupts masked
+static uint32_t enterCritical(void)
+{
+    uint32_t mask = __get_PRIMASK();
+    __disable_irq();
+    return mask;
+}
+
+static void exitCritical(uint32_t mask)
+{
+    __set_PRIMASK(mask);
+}
+
+void uartTxInit(void)
+{
+    RCC->AHBENR |= RCC_AHBENR_DMA2EN;
+    DMA2->CSELR |= DMA2_CSELR_CH1_USART5_TX;
+    DMA2_Channel1->CCR &= ~DMA_CCR_EN;
+
+    //memory to peripheral, byte wide, incrementing memory, interrupt on completion
+    DMA2_Channel1->CPAR = (uint32_t) &(USART5->TDR);
+    DMA2_Channel1->CCR &= ~(DMA_CCR_MSIZE | DMA_CCR_PSIZE | DMA_CCR_CIRC);
+    DMA2_Channel1->CCR |= DMA_CCR_DIR;
+    DMA2_Channel1->CCR |= DMA_CCR_MINC;
+    DMA2_Channel1->CCR |= DMA_CCR_TCIE;
+
+    USART5->CR3 |= USART_CR3_DMAT;
+    NVIC->ISER[0] |= (1 << DMA1_Ch2_3_DMA2_Ch1_2_IRQn);
+}
+
+//hands one contiguous run of the ring to the DMA channel
+RAMFUNC static void startDma(uint16_t start, uint16_t length)
+{
+    DMA2_Channel1->CCR &= ~DMA_CCR_EN;
+    DMA2_Channel1->CMAR = (uint32_t) &txRing[start];
+    DMA2_Channel1->CNDTR = length;
+    DMA2_Channel1->CCR |= DMA_CCR_EN;
+}
+
+//called from the shared DMA interrupt handler in main.c
+RAMFUNC void uartTxHandleDmaInterrupt(void)
+{
+    if(DMA2->ISR & DMA_ISR_TCIF1)
+    {
+        DMA2->IFCR = DMA_IFCR_CGIF1;
+        transferComplete();
+    }
+}
+
+//waits until the ring is empty and the last byte has left the shift register
+void uartTxFlush(void)
+{
+    while(txHead != txTail || txInFlight);
+    while(!(USART5->ISR & USART_ISR_TC));
+}
+
+#else
+
+static uint32_t enterCritical(void)
+{
+    return 0;
+}
+
+static void exitCritical(uint32_t mask)
+{
+    (void)mask;
+}
+
+void uartTxInit(void)
+{
+}
+
+//the simulated transmitter sends a run instantly
+static void startDma(uint16_t start, uint16_t length)
+{
+    fwrite(&txRing[start], 1, length, stdout);
+    transferComplete();
+}
+
+void uartTxHandleDmaInterrupt(void)
+{
+}
+
+void uartTxFlush(void)
+{
+    fflush(stdout);
+}
+
+#endif
+
+static uint16_t ringFree(void)
+{
+    uint16_t used = (txHead - txTail + UART_TX_RING_SIZE) % UART_TX_RING_SIZE;
+    return UART_TX_RING_SIZE - 1 - used;
+}
+
+//starts the next run if the transmitter is idle, called with interrupts masked
+RAMFUNC static void startTransfer(void)
+{
+    if(txInFlight || txHead == txTail)
+    {
+        return;
+    }
+
+    //a run cannot wrap, the part after the end of the ring goes in the next transfer
+    uint16_t length = (txHead > txTail) ? txHead - txTail : UART_TX_RING_SIZE - txTail;
+    txInFlight = length;
+    txStats.dmaTransfers++;
+    startDma(txTail, length);
+}
+
+RAMFUNC static void transferComplete(void)
+{
+    txTail = (txTail + txInFlight) % UART_TX_RING_SIZE;
+    txInFlight = 0;
+    startTransfer();
+}
+
+//queues a span for transmission, turning \n into \r\n like __io_putchar always did
+//waits for ring space if needed, only ever called from main context
+int uartTxWrite(const char* data, int length)
+{
+    uint32_t startCycles = cycleCounterNow();
+    int i = 0;
+
+    while(i < length)
+    {
+        uint32_t mask = enterCritical();
+        uint16_t head = txHead;
+        uint16_t space = ringFree();
+
+        while(i < length && space > 0)
+        {
+            if(data[i] == '\n')
+            {
+                if(space < 2)
+                {
+                    break;
+                }
+                txRing[head] = '\r';
+                head = (head + 1) % UART_TX_RING_SIZE;
+                space--;
+                txStats.bytesQueued++;
+            }
+            txRing[head] = data[i++];
+            head = (head + 1) % UART_TX_RING_SIZE;
+            space--;
+            txStats.bytesQueued++;
+        }
+        txHead = head;
+        startTransfer();
+        exitCritical(mask);
+
+        //room appears as the DMA interrupt retires runs
+        while(i < length && ringFree() < 2);
+    }
+
+    txStats.cpuCycles += cycleCounterNow() - startCycles;
+    return i;
+}
+
+void uartTxGetStats(UartTxStats* stats)
+{
+    *stats = txStats;
+}
+
+void uartTxResetStats(void)
+{
+    UartTxStats cleared = { 0 };
+    txStats = cleared;
+}